@@ -0,0 +1,113 @@
+#!/usr/bin/env sh
+# Benchmark the HuVideo decoder on synthetic images.
+#
+# usage:
+#   bench.sh decoder generator [runs]
+# with decoder  : binary generated from huvideo_decode.c
+#      generator: binary generated from huvideo_gen.c
+#      runs     : number of runs of each benchmark, the fastest one is kept (default: 3)
+#
+# Each benchmark prints a JSON object on its own line:
+#   {"bench":"pg2-png","stage":"encode","runs":3,"seconds":0.512,"frames":1200,"frames_per_s":2343.8,"input_mb_s":20.1,"output_mb_s":12.4}
+# input_mb_s is the image size divided by the run time, output_mb_s the size of the files written.
+# The checksum and ADPCM benchmarks (stages "checksum" and "audio") report the best time of a single buffer, their frames are 0.
+#
+if [ ! -f "${1}" ] || [ ! -x "${1}" ]; then
+    echo "${1} is not an executable file"
+    exit 1
+fi
+
+if [ ! -f "${2}" ] || [ ! -x "${2}" ]; then
+    echo "${2} is not an executable file"
+    exit 1
+fi
+
+decoder="${1}"
+generator="${2}"
+runs="${3:-3}"
+
+work=`mktemp -d`
+trap 'rm -rf "${work}"' EXIT
+
+now() {
+    date +%s%N
+}
+
+# bench <name> <stage> <image> <game> <decoder options...>
+# Frames and videos are written to a tar archive on the standard output unless --output is the first option,
+# in which case they are written to a directory.
+bench() {
+    name="${1}"; stage="${2}"; image="${3}"; game="${4}"
+    shift 4
+    to_dir=0
+    if [ "${1}" = "--output" ]; then
+        to_dir=1
+        shift
+    fi
+    best=""
+    for run in `seq ${runs}`; do
+        rm -rf "${work}/out"
+        mkdir "${work}/out"
+        start=`now`
+        if [ ${to_dir} -eq 1 ]; then
+            "${decoder}" -g ${game} --no-cache "$@" "${image}" "${work}/out" 2> "${work}/log"
+            bytes=`du -sb "${work}/out" | cut -f 1`
+        else
+            bytes=`"${decoder}" -g ${game} --tar - "$@" "${image}" 2> "${work}/log" | wc -c`
+        fi
+        end=`now`
+        elapsed=$((end - start))
+        if [ -z "${best}" ] || [ ${elapsed} -lt ${best} ]; then
+            best=${elapsed}
+        fi
+    done
+    frames=`sed -n 's/^[0-9]* videos extracted, \([0-9]*\) frames.*/\1/p' "${work}/log"`
+    input=`wc -c < "${image}"`
+    awk -v name="${name}" -v stage="${stage}" -v runs="${runs}" -v ns="${best}" -v frames="${frames:-0}" \
+        -v input="${input}" -v output="${bytes}" 'BEGIN {
+        s = ns / 1e9; if(s <= 0) s = 1e-9;
+        printf("{\"bench\":\"%s\",\"stage\":\"%s\",\"runs\":%d,\"seconds\":%.4f,\"frames\":%d,\"frames_per_s\":%.1f,\"input_mb_s\":%.1f,\"output_mb_s\":%.1f}\n",
+               name, stage, runs, s, frames, frames / s, input / s / 1048576, output / s / 1048576);
+    }'
+}
+
+# Images: 8 Power Golf 2 videos (256x112), 9 Madden videos (256x112, 128x128 and sprites with adpcm data),
+# and 20000 sectors without any video for the header scan.
+"${generator}" -g 0 --videos 8 --frames 300 --hold 2 --seed 1 "${work}/pg2.bin" 2> /dev/null || exit 1
+"${generator}" -g 1 --videos 9 --frames 200 --hold 3 --seed 2 "${work}/madden.bin" 2> /dev/null || exit 1
+"${generator}" -g 0 --videos 0 --gap 20000 --seed 3 "${work}/scan.bin" 2> /dev/null || exit 1
+
+bench scan           scan    "${work}/scan.bin"   0 --format raw
+bench pg2-raw        read    "${work}/pg2.bin"    0 --format raw
+bench pg2-raw-rgb    convert "${work}/pg2.bin"    0 --format raw-rgb
+bench pg2-png        encode  "${work}/pg2.bin"    0 --format png
+bench pg2-qoi        encode  "${work}/pg2.bin"    0 --format qoi
+bench pg2-gif        encode  "${work}/pg2.bin"    0 --format gif
+bench pg2-png-files  write   "${work}/pg2.bin"    0 --output --format png
+bench pg2-raw-files  write   "${work}/pg2.bin"    0 --output --format raw-rgb
+bench madden-raw     read    "${work}/madden.bin" 1 --format raw --audio wav
+bench madden-png     encode  "${work}/madden.bin" 1 --format png --audio wav
+bench madden-avi     encode  "${work}/madden.bin" 1 --format avi
+
+# CRC-32 and Adler-32 (cache keys, duplicate frames, PNG and zlib) through --bench-kernels.
+"${decoder}" --bench-kernels=${runs} | awk -v runs="${runs}" '
+/^(crc32|adler32) / {
+    name = $1 "-" substr($2, 2, length($2) - 2) "-" $3
+    mb_s = $(NF-1)
+    s = (mb_s > 0) ? ($3 / 1048576 / mb_s) : 0
+    printf("{\"bench\":\"%s\",\"stage\":\"checksum\",\"runs\":%d,\"seconds\":%.6f,\"frames\":0,\"frames_per_s\":0.0,\"input_mb_s\":%.1f,\"output_mb_s\":0.0}\n",
+           name, runs, s, mb_s);
+}'
+
+# OKI ADPCM decoder through --bench-kernels, samples_per_s is the number of decoded samples (2 per byte) per second.
+"${decoder}" --bench-kernels=${runs} | awk -v runs="${runs}" '
+/^oki/ {
+    bytes = $(NF-5)
+    name = $1
+    for(i=2; i<(NF-5); i++) name = name "-" substr($i, 2, length($i) - 2)
+    name = name "-" bytes
+    msmp_s = $(NF-1)
+    s = (msmp_s > 0) ? (2 * bytes / 1e6 / msmp_s) : 0
+    printf("{\"bench\":\"%s\",\"stage\":\"audio\",\"runs\":%d,\"seconds\":%.6f,\"frames\":0,\"frames_per_s\":0.0,\"input_mb_s\":%.1f,\"output_mb_s\":%.1f,\"samples_per_s\":%.0f}\n",
+           name, runs, s, (s > 0) ? (bytes / s / 1048576) : 0, (s > 0) ? (4 * bytes / s / 1048576) : 0, msmp_s * 1e6);
+}'
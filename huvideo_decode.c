@@ -5,18 +5,35 @@
  * Use at your own risk
  * 2020 - Vincent Cruz
  */
+#define _GNU_SOURCE     // syncfs
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// PNG frames are compressed with our own deflate and checksum implementations.
+unsigned char* huvideo_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality);
+#define STBIW_ZLIB_COMPRESS huvideo_zlib_compress
+unsigned int huvideo_crc32(unsigned char *buffer, int len);
+#define STBIW_CRC32 huvideo_crc32
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+#include "huvideo_store.h"
+
 // madden ad_trans call : 51f6 sect #: $1185 count: $11
 // ad_play: call 567d
 //      _bx 0040
@@ -25,6 +42,7 @@
 //      _dl 00
 // init des params adpcm $5238 (w 1v 1c)
 static uint32_t g_sector_size = 0x0930; // redump seems to be using mode1, so sectors are 2352 bytes long.
+static int g_fps = 25; // frame rate of animated outputs.
 
 enum GameID {
     PowerGolf2,
@@ -46,295 +64,4720 @@ struct header_t {
     uint16_t unknown[3];
 };
 
-/* This part is based upon the source code found in Power Golf 2 and Beyond Shadowgate. */
-int decode_header(FILE *in, struct header_t *header) {
-    static const char magic[16] = "HuVIDEO         ";
-    
-    size_t n_read;
-    uint8_t buffer[16];
+/*
+ * CRC32 (PNG chunks) and Adler-32 (zlib streams) checksums.
+ * The SIMD implementations (PCLMULQDQ folding for CRC32, SSSE3 for Adler-32) are selected at runtime
+ * when the CPU supports them. Otherwise the portable ones are used.
+ */
+#define ADLER32_BASE 65521
+// Largest n such that 255n(n+1)/2 + (n+1)(ADLER32_BASE-1) fits in 32 bits.
+#define ADLER32_NMAX 5552
 
-    n_read = fread(buffer, 1, 16, in);
-    if(n_read != 16) {
-        fprintf(stderr, "failed to read header ID.\n");
-        return 0;
+typedef uint32_t (*checksum_func_t)(uint32_t, const uint8_t*, size_t);
+
+static uint32_t g_crc32_table[8][256];
+
+static uint32_t crc32_generic(uint32_t crc, const uint8_t *data, size_t len);
+static uint32_t adler32_generic(uint32_t adler, const uint8_t *data, size_t len);
+
+static checksum_func_t g_crc32_func = crc32_generic;
+static checksum_func_t g_adler32_func = adler32_generic;
+static const char *g_crc32_name = "slice-by-8";
+static const char *g_adler32_name = "generic";
+
+// Slicing-by-8 table based CRC32. The CRC is not inverted.
+static uint32_t crc32_generic(uint32_t crc, const uint8_t *data, size_t len) {
+    while(len && ((uintptr_t)data & 7)) {
+        crc = (crc >> 8) ^ g_crc32_table[0][(crc ^ *data++) & 0xff];
+        len--;
     }
-    if(memcmp(buffer, magic, 16)) {
-        fprintf(stderr, "invalid header ID.\n");
+    for(; len>=8; len-=8, data+=8) {
+        uint32_t lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24));
+        uint32_t hi = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+        crc = g_crc32_table[7][lo & 0xff] ^ g_crc32_table[6][(lo >> 8) & 0xff]
+            ^ g_crc32_table[5][(lo >> 16) & 0xff] ^ g_crc32_table[4][lo >> 24]
+            ^ g_crc32_table[3][hi & 0xff] ^ g_crc32_table[2][(hi >> 8) & 0xff]
+            ^ g_crc32_table[1][(hi >> 16) & 0xff] ^ g_crc32_table[0][hi >> 24];
+    }
+    while(len--) {
+        crc = (crc >> 8) ^ g_crc32_table[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+static uint32_t adler32_generic(uint32_t adler, const uint8_t *data, size_t len) {
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+    while(len) {
+        size_t n = (len > ADLER32_NMAX) ? ADLER32_NMAX : len;
+        len -= n;
+        while(n--) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= ADLER32_BASE;
+        s2 %= ADLER32_BASE;
+    }
+    return (s2 << 16) | s1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// CRC32 folding using carry-less multiplication.
+// See "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, size_t len) {
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    if(len < 64) {
+        return crc32_generic(crc, data, len);
+    }
+
+    x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    data += 64;
+    len -= 64;
+
+    // Fold 4x128 bits at a time.
+    while(len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+        data += 64;
+        len -= 64;
+    }
+
+    // Fold into 128 bits.
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Fold 128 bits at a time.
+    while(len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)data);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        data += 16;
+        len -= 16;
+    }
+
+    // Fold 128 bits to 64 bits.
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barret reduction to 32 bits.
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = _mm_extract_epi32(x1, 1);
+
+    return len ? crc32_generic(crc, data, len) : crc;
+}
+
+// Adler-32 on 32 bytes blocks. s2 is updated with the byte weights (32..1) of each block.
+__attribute__((target("ssse3")))
+static uint32_t adler32_ssse3(uint32_t adler, const uint8_t *data, size_t len) {
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+    size_t blocks = len / 32;
+    const __m128i tap1 = _mm_setr_epi8(32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17);
+    const __m128i tap2 = _mm_setr_epi8(16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    len -= blocks * 32;
+    while(blocks) {
+        size_t n = (blocks > (ADLER32_NMAX/32)) ? (ADLER32_NMAX/32) : blocks;
+        blocks -= n;
+
+        __m128i v_ps = _mm_set_epi32(0, 0, 0, s1 * (uint32_t)n);
+        __m128i v_s2 = _mm_set_epi32(0, 0, 0, s2);
+        __m128i v_s1 = _mm_setzero_si128();
+        do {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+            data += 32;
+        } while(--n);
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2,3,0,1)));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1,0,3,2)));
+        s1 += _mm_cvtsi128_si32(v_s1);
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2,3,0,1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1,0,3,2)));
+        s2 = _mm_cvtsi128_si32(v_s2);
+
+        s1 %= ADLER32_BASE;
+        s2 %= ADLER32_BASE;
+    }
+    return len ? adler32_generic((s2 << 16) | s1, data, len) : ((s2 << 16) | s1);
+}
+#endif // __x86_64__ || __i386__
+
+// Build the CRC tables and select the checksum implementations supported by the CPU.
+static void checksum_init() {
+    static int initialized = 0;
+    if(initialized) {
+        return;
+    }
+    for(uint32_t i=0; i<256; i++) {
+        uint32_t c = i;
+        for(int k=0; k<8; k++) {
+            c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+        }
+        g_crc32_table[0][i] = c;
+    }
+    for(int i=0; i<256; i++) {
+        for(int k=1; k<8; k++) {
+            g_crc32_table[k][i] = (g_crc32_table[k-1][i] >> 8) ^ g_crc32_table[0][g_crc32_table[k-1][i] & 0xff];
+        }
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        g_crc32_func = crc32_pclmul;
+        g_crc32_name = "pclmul";
+    }
+    if(__builtin_cpu_supports("ssse3")) {
+        g_adler32_func = adler32_ssse3;
+        g_adler32_name = "ssse3";
+    }
+#endif
+    initialized = 1;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    checksum_init();
+    return ~g_crc32_func(~crc, data, len);
+}
+
+uint32_t adler32(uint32_t adler, const uint8_t *data, size_t len) {
+    checksum_init();
+    return g_adler32_func(adler, data, len);
+}
+
+// stb_image_write PNG chunk CRC (see STBIW_CRC32).
+unsigned int huvideo_crc32(unsigned char *buffer, int len) {
+    return crc32_update(0, buffer, len);
+}
+
+/*
+ * Deflate backend used by stb_image_write for PNG output.
+ * The compression level selects one of the following modes:
+ *    0   : stored blocks only (no compression at all).
+ *    1-3 : greedy matching with a short hash chain and fixed huffman codes.
+ *    4-8 : lazy matching with longer hash chains, fixed or dynamic huffman codes (whichever is smaller).
+ *    9   : exhaustive hash chains for the best compression ratio.
+ */
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_BLOCK_TOKENS 16384
+#define DEFLATE_TOO_FAR 4096
+#define DEFLATE_LOOKAHEAD (DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH + 1)
+#define DEFLATE_BUFFER_SIZE (2*DEFLATE_WINDOW_SIZE)
+
+struct deflate_level_t {
+    uint16_t chain;     // maximum number of hash chain entries visited.
+    uint16_t lazy;      // do not look for a better match if the current one is at least this long (0: greedy).
+    uint16_t nice;      // stop searching once a match of this length is found.
+    uint8_t dynamic;    // emit dynamic huffman blocks when they are smaller.
+};
+
+static const struct deflate_level_t g_deflate_levels[10] = {
+    {    0,   0,   0, 0 },
+    {    1,   0,  16, 0 },
+    {    2,   0,  32, 0 },
+    {    4,   0,  64, 0 },
+    {    4,   8,  32, 1 },
+    {    8,  16,  64, 1 },
+    {   16,  16, 128, 1 },
+    {   16,  32, 128, 1 },
+    {   32,  32, 258, 1 },
+    { 4096, 258, 258, 1 }
+};
+
+static const uint16_t g_deflate_length_base[29] = {
+    3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258
+};
+static const uint8_t g_deflate_length_extra[29] = {
+    0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0
+};
+static const uint16_t g_deflate_dist_base[30] = {
+    1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577
+};
+static const uint8_t g_deflate_dist_extra[30] = {
+    0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13
+};
+static const uint8_t g_deflate_code_length_order[19] = {
+    16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15
+};
+
+// Length (3..258) to length code and distance-1 to distance code lookup tables.
+static uint8_t g_deflate_length_code[DEFLATE_MAX_MATCH+1];
+static uint8_t g_deflate_dist_code[512];
+
+struct deflate_token_t {
+    uint16_t value;     // literal byte or match length.
+    uint16_t dist;      // match distance (0 for literals).
+};
+
+struct deflate_t {
+    const struct deflate_level_t *level;
+
+    uint8_t *out;
+    size_t out_len;
+    size_t out_capacity;
+    uint64_t bits;
+    int bit_count;
+
+    const uint8_t *data;
+    size_t data_len;
+    size_t pos;             // current position in data.
+    size_t block_start;     // start of the pending block in data.
+    size_t block_end;       // end of the data covered by the pending block tokens.
+    uint8_t *window;        // streaming input buffer (data points to it).
+    uint32_t adler;
+
+    int32_t *head;
+    int32_t *prev;
+
+    // Lazy matching state.
+    int prev_len;
+    int prev_dist;
+    int available;
+
+    struct deflate_token_t tokens[DEFLATE_BLOCK_TOKENS];
+    size_t token_count;
+};
+
+static void deflate_init_tables() {
+    static int initialized = 0;
+    if(initialized) {
+        return;
+    }
+    for(int code=0; code<28; code++) {
+        for(int i=0; i<(1<<g_deflate_length_extra[code]); i++) {
+            g_deflate_length_code[g_deflate_length_base[code] + i] = code;
+        }
+    }
+    g_deflate_length_code[DEFLATE_MAX_MATCH] = 28;
+    for(int code=0; code<30; code++) {
+        for(int i=0; i<(1<<g_deflate_dist_extra[code]); i++) {
+            int d = g_deflate_dist_base[code] + i - 1;
+            if(d < 256) {
+                g_deflate_dist_code[d] = code;
+            }
+            else {
+                g_deflate_dist_code[256 + (d >> 7)] = code;
+            }
+        }
+    }
+    initialized = 1;
+}
+
+static inline int deflate_dist_code(int dist) {
+    dist--;
+    return (dist < 256) ? g_deflate_dist_code[dist] : g_deflate_dist_code[256 + (dist >> 7)];
+}
+
+static int deflate_reserve(struct deflate_t *z, size_t n) {
+    if((z->out_len + n) > z->out_capacity) {
+        size_t capacity = 2*z->out_capacity + n;
+        uint8_t *out = (uint8_t*)realloc(z->out, capacity);
+        if(out == NULL) {
+            return 0;
+        }
+        z->out = out;
+        z->out_capacity = capacity;
+    }
+    return 1;
+}
+
+// Bits are written LSB first. The caller must have reserved enough output space.
+static inline void deflate_put_bits(struct deflate_t *z, uint32_t value, int n) {
+    z->bits |= (uint64_t)value << z->bit_count;
+    z->bit_count += n;
+    while(z->bit_count >= 8) {
+        z->out[z->out_len++] = (uint8_t)z->bits;
+        z->bits >>= 8;
+        z->bit_count -= 8;
+    }
+}
+
+static void deflate_align(struct deflate_t *z) {
+    if(z->bit_count) {
+        deflate_put_bits(z, 0, 8 - z->bit_count);
+    }
+}
+
+static uint32_t deflate_reverse(uint32_t code, int n) {
+    uint32_t res = 0;
+    while(n--) {
+        res = (res << 1) | (code & 1);
+        code >>= 1;
+    }
+    return res;
+}
+
+static int deflate_compare_freq(const void *a, const void *b) {
+    const uint32_t *u = (const uint32_t*)a;
+    const uint32_t *v = (const uint32_t*)b;
+    if(u[0] != v[0]) {
+        return (u[0] < v[0]) ? -1 : 1;
+    }
+    return (u[1] < v[1]) ? -1 : (u[1] > v[1]);
+}
+
+// Compute length limited huffman code lengths.
+static void deflate_build_lengths(const uint32_t *freq, int n, int max_bits, uint8_t *lengths) {
+    uint32_t sorted[286][2];
+    uint32_t weight[2*286];
+    int parent[2*286];
+    int depth[2*286];
+    int count[33];
+    int m = 0;
+
+    memset(lengths, 0, n);
+    for(int i=0; i<n; i++) {
+        if(freq[i]) {
+            sorted[m][0] = freq[i];
+            sorted[m][1] = i;
+            m++;
+        }
+    }
+    // A valid code needs at least 2 symbols.
+    if(m < 2) {
+        int used = m ? sorted[0][1] : 0;
+        lengths[used] = 1;
+        lengths[used ? 0 : 1] = 1;
+        return;
+    }
+    qsort(sorted, m, sizeof(sorted[0]), deflate_compare_freq);
+
+    // Two queues huffman tree construction: leaves are [0,m), internal nodes [m,2m-1).
+    for(int i=0; i<m; i++) {
+        weight[i] = sorted[i][0];
+    }
+    int leaf = 0, node = m;
+    for(int next=m; next<(2*m-1); next++) {
+        int child[2];
+        for(int k=0; k<2; k++) {
+            if((leaf < m) && ((node >= next) || (weight[leaf] <= weight[node]))) {
+                child[k] = leaf++;
+            }
+            else {
+                child[k] = node++;
+            }
+        }
+        weight[next] = weight[child[0]] + weight[child[1]];
+        parent[child[0]] = parent[child[1]] = next;
+    }
+    depth[2*m-2] = 0;
+    for(int i=2*m-3; i>=0; i--) {
+        depth[i] = depth[parent[i]] + 1;
+    }
+
+    // Enforce the maximum code length (Kraft inequality fixup).
+    memset(count, 0, sizeof(count));
+    for(int i=0; i<m; i++) {
+        count[(depth[i] > 32) ? 32 : depth[i]]++;
+    }
+    for(int i=max_bits+1; i<=32; i++) {
+        count[max_bits] += count[i];
+    }
+    uint32_t total = 0;
+    for(int i=max_bits; i>0; i--) {
+        total += (uint32_t)count[i] << (max_bits - i);
+    }
+    while(total != (1U << max_bits)) {
+        count[max_bits]--;
+        for(int i=max_bits-1; i>0; i--) {
+            if(count[i]) {
+                count[i]--;
+                count[i+1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // The most frequent symbols get the shortest codes.
+    for(int len=1, k=m-1; len<=max_bits; len++) {
+        for(int i=0; i<count[len]; i++, k--) {
+            lengths[sorted[k][1]] = len;
+        }
+    }
+}
+
+// Compute canonical huffman codes (bit reversed) from code lengths.
+static void deflate_build_codes(const uint8_t *lengths, int n, uint16_t *codes) {
+    int count[16] = {0};
+    int next[16];
+    for(int i=0; i<n; i++) {
+        count[lengths[i]]++;
+    }
+    count[0] = 0;
+    next[0] = 0;
+    for(int i=1, code=0; i<16; i++) {
+        code = (code + count[i-1]) << 1;
+        next[i] = code;
+    }
+    for(int i=0; i<n; i++) {
+        if(lengths[i]) {
+            codes[i] = deflate_reverse(next[lengths[i]]++, lengths[i]);
+        }
+    }
+}
+
+static void deflate_fixed_lengths(uint8_t *litlen, uint8_t *dist) {
+    int i;
+    for(i=0; i<144; i++) litlen[i] = 8;
+    for(   ; i<256; i++) litlen[i] = 9;
+    for(   ; i<280; i++) litlen[i] = 7;
+    for(   ; i<288; i++) litlen[i] = 8;
+    for(i=0; i<30; i++) dist[i] = 5;
+}
+
+// Run length encode code lengths (symbols 16, 17 and 18). Returns the number of ops.
+static int deflate_rle_lengths(const uint8_t *lengths, int n, uint8_t *ops, uint8_t *extra) {
+    int count = 0;
+    for(int i=0; i<n; ) {
+        int len = lengths[i];
+        int run = 1;
+        while(((i+run) < n) && (lengths[i+run] == len)) {
+            run++;
+        }
+        i += run;
+        if(len == 0) {
+            while(run >= 11) {
+                int r = (run > 138) ? 138 : run;
+                ops[count] = 18; extra[count++] = r - 11;
+                run -= r;
+            }
+            if(run >= 3) {
+                ops[count] = 17; extra[count++] = run - 3;
+                run = 0;
+            }
+        }
+        else {
+            ops[count] = len; extra[count++] = 0;
+            run--;
+            while(run >= 3) {
+                int r = (run > 6) ? 6 : run;
+                ops[count] = 16; extra[count++] = r - 3;
+                run -= r;
+            }
+        }
+        while(run--) {
+            ops[count] = len; extra[count++] = 0;
+        }
+    }
+    return count;
+}
+
+static void deflate_write_tokens(struct deflate_t *z, const uint16_t *litlen_codes, const uint8_t *litlen_lengths, const uint16_t *dist_codes, const uint8_t *dist_lengths) {
+    for(size_t i=0; i<z->token_count; i++) {
+        struct deflate_token_t *t = &z->tokens[i];
+        if(t->dist == 0) {
+            deflate_put_bits(z, litlen_codes[t->value], litlen_lengths[t->value]);
+        }
+        else {
+            int lc = g_deflate_length_code[t->value];
+            int dc = deflate_dist_code(t->dist);
+            deflate_put_bits(z, litlen_codes[257+lc], litlen_lengths[257+lc]);
+            deflate_put_bits(z, t->value - g_deflate_length_base[lc], g_deflate_length_extra[lc]);
+            deflate_put_bits(z, dist_codes[dc], dist_lengths[dc]);
+            deflate_put_bits(z, t->dist - g_deflate_dist_base[dc], g_deflate_dist_extra[dc]);
+        }
+    }
+    deflate_put_bits(z, litlen_codes[256], litlen_lengths[256]);
+}
+
+static int deflate_write_stored(struct deflate_t *z, const uint8_t *data, size_t len, int last) {
+    if(!deflate_reserve(z, len + 5*(len/65535 + 1) + 8)) {
         return 0;
     }
-    n_read = fread(&header->frames, 1, 2, in);
-    if(n_read != 2) {
-        fprintf(stderr, "failed to read frame count.\n");
+    do {
+        size_t n = (len > 65535) ? 65535 : len;
+        len -= n;
+        deflate_put_bits(z, (last && !len) ? 1 : 0, 1);
+        deflate_put_bits(z, 0, 2);
+        deflate_align(z);
+        deflate_put_bits(z, n & 0xffff, 16);
+        deflate_put_bits(z, ~n & 0xffff, 16);
+        memcpy(z->out + z->out_len, data, n);
+        z->out_len += n;
+        data += n;
+    } while(len);
+    return 1;
+}
+
+// Emit the pending tokens as a stored, fixed or dynamic huffman block whichever is the smallest.
+static int deflate_flush_block(struct deflate_t *z, const struct deflate_level_t *level, int last) {
+    uint32_t litlen_freq[286] = {0};
+    uint32_t dist_freq[30] = {0};
+    uint8_t fixed_litlen[288], fixed_dist[30];
+    uint8_t litlen_lengths[286], dist_lengths[30];
+    uint16_t litlen_codes[288], dist_codes[30];
+    uint8_t lengths[286+30];
+    uint8_t ops[286+30], extra[286+30];
+    uint32_t cl_freq[19] = {0};
+    uint8_t cl_lengths[19];
+    uint16_t cl_codes[19];
+    uint64_t extra_bits = 0;
+    uint64_t fixed_bits, dynamic_bits, stored_bits;
+    size_t raw_len = z->block_end - z->block_start;
+    int hlit, hdist, hclen, op_count = 0;
+
+    for(size_t i=0; i<z->token_count; i++) {
+        struct deflate_token_t *t = &z->tokens[i];
+        if(t->dist == 0) {
+            litlen_freq[t->value]++;
+        }
+        else {
+            int lc = g_deflate_length_code[t->value];
+            int dc = deflate_dist_code(t->dist);
+            litlen_freq[257+lc]++;
+            dist_freq[dc]++;
+            extra_bits += g_deflate_length_extra[lc] + g_deflate_dist_extra[dc];
+        }
+    }
+    litlen_freq[256] = 1;
+
+    deflate_fixed_lengths(fixed_litlen, fixed_dist);
+    fixed_bits = 3 + extra_bits;
+    for(int i=0; i<286; i++) fixed_bits += (uint64_t)litlen_freq[i] * fixed_litlen[i];
+    for(int i=0; i<30; i++)  fixed_bits += (uint64_t)dist_freq[i] * fixed_dist[i];
+
+    stored_bits = 3 + 7 + (uint64_t)(raw_len + 5*(raw_len/65535 + 1)) * 8;
+    dynamic_bits = ~(uint64_t)0;
+
+    if(level->dynamic) {
+        deflate_build_lengths(litlen_freq, 286, 15, litlen_lengths);
+        deflate_build_lengths(dist_freq, 30, 15, dist_lengths);
+        for(hlit=286; (hlit>257) && !litlen_lengths[hlit-1]; hlit--) {}
+        for(hdist=30; (hdist>1) && !dist_lengths[hdist-1]; hdist--) {}
+        memcpy(lengths, litlen_lengths, hlit);
+        memcpy(lengths+hlit, dist_lengths, hdist);
+        op_count = deflate_rle_lengths(lengths, hlit+hdist, ops, extra);
+        for(int i=0; i<op_count; i++) {
+            cl_freq[ops[i]]++;
+        }
+        deflate_build_lengths(cl_freq, 19, 7, cl_lengths);
+        for(hclen=19; (hclen>4) && !cl_lengths[g_deflate_code_length_order[hclen-1]]; hclen--) {}
+
+        dynamic_bits = 3 + 5 + 5 + 4 + 3*hclen + extra_bits;
+        for(int i=0; i<op_count; i++) {
+            dynamic_bits += cl_lengths[ops[i]] + ((ops[i] == 16) ? 2 : (ops[i] == 17) ? 3 : (ops[i] == 18) ? 7 : 0);
+        }
+        for(int i=0; i<286; i++) dynamic_bits += (uint64_t)litlen_freq[i] * litlen_lengths[i];
+        for(int i=0; i<30; i++)  dynamic_bits += (uint64_t)dist_freq[i] * dist_lengths[i];
+    }
+
+    if((stored_bits <= fixed_bits) && (stored_bits <= dynamic_bits)) {
+        if(!deflate_write_stored(z, z->data + z->block_start, raw_len, last)) {
+            return 0;
+        }
+    }
+    else if(fixed_bits <= dynamic_bits) {
+        if(!deflate_reserve(z, fixed_bits/8 + 16)) {
+            return 0;
+        }
+        deflate_build_codes(fixed_litlen, 288, litlen_codes);
+        deflate_build_codes(fixed_dist, 30, dist_codes);
+        deflate_put_bits(z, last, 1);
+        deflate_put_bits(z, 1, 2);
+        deflate_write_tokens(z, litlen_codes, fixed_litlen, dist_codes, fixed_dist);
+    }
+    else {
+        if(!deflate_reserve(z, dynamic_bits/8 + 16)) {
+            return 0;
+        }
+        deflate_build_codes(litlen_lengths, 286, litlen_codes);
+        deflate_build_codes(dist_lengths, 30, dist_codes);
+        deflate_build_codes(cl_lengths, 19, cl_codes);
+        deflate_put_bits(z, last, 1);
+        deflate_put_bits(z, 2, 2);
+        deflate_put_bits(z, hlit - 257, 5);
+        deflate_put_bits(z, hdist - 1, 5);
+        deflate_put_bits(z, hclen - 4, 4);
+        for(int i=0; i<hclen; i++) {
+            deflate_put_bits(z, cl_lengths[g_deflate_code_length_order[i]], 3);
+        }
+        for(int i=0; i<op_count; i++) {
+            deflate_put_bits(z, cl_codes[ops[i]], cl_lengths[ops[i]]);
+            if(ops[i] == 16) {
+                deflate_put_bits(z, extra[i], 2);
+            }
+            else if(ops[i] == 17) {
+                deflate_put_bits(z, extra[i], 3);
+            }
+            else if(ops[i] == 18) {
+                deflate_put_bits(z, extra[i], 7);
+            }
+        }
+        deflate_write_tokens(z, litlen_codes, litlen_lengths, dist_codes, dist_lengths);
+    }
+
+    z->token_count = 0;
+    z->block_start = z->block_end;
+    return 1;
+}
+
+static inline uint32_t deflate_hash(const uint8_t *p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761U) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static inline void deflate_insert(struct deflate_t *z, size_t pos) {
+    uint32_t h = deflate_hash(z->data + pos);
+    z->prev[pos & (DEFLATE_WINDOW_SIZE-1)] = z->head[h];
+    z->head[h] = (int32_t)pos;
+}
+
+static inline int deflate_match_length(const uint8_t *a, const uint8_t *b, int limit) {
+    int len = 0;
+    while((len + 8) <= limit) {
+        uint64_t u, v;
+        memcpy(&u, a+len, 8);
+        memcpy(&v, b+len, 8);
+        if(u != v) {
+            return len + (__builtin_ctzll(u ^ v) >> 3);
+        }
+        len += 8;
+    }
+    while((len < limit) && (a[len] == b[len])) {
+        len++;
+    }
+    return len;
+}
+
+// Find the longest match for the current position. The position must not be inserted yet.
+static int deflate_longest_match(struct deflate_t *z, size_t pos, const struct deflate_level_t *level, int best, int *dist) {
+    const uint8_t *current = z->data + pos;
+    size_t remaining = z->data_len - pos;
+    int limit = (remaining > DEFLATE_MAX_MATCH) ? DEFLATE_MAX_MATCH : (int)remaining;
+    int32_t candidate = z->head[deflate_hash(current)];
+    int chain = level->chain;
+
+    if(best >= limit) {
         return 0;
     }
-    n_read = fread(&header->width, 1, 2, in);
-    if(n_read != 2) {
-        fprintf(stderr, "failed to read frame width.\n");
+    best = (best < (DEFLATE_MIN_MATCH-1)) ? (DEFLATE_MIN_MATCH-1) : best;
+    *dist = 0;
+    while((candidate >= 0) && chain-- && ((pos - candidate) <= DEFLATE_WINDOW_SIZE)) {
+        const uint8_t *match = z->data + candidate;
+        if(match[best] == current[best]) {
+            int len = deflate_match_length(match, current, limit);
+            if(len > best) {
+                best = len;
+                *dist = (int)(pos - candidate);
+                // match[best] would be past the end of the input.
+                if((len >= level->nice) || (len >= limit)) {
+                    break;
+                }
+            }
+        }
+        int32_t next = z->prev[candidate & (DEFLATE_WINDOW_SIZE-1)];
+        if(next >= candidate) {
+            break;
+        }
+        candidate = next;
+    }
+    if(!*dist || ((best == DEFLATE_MIN_MATCH) && (*dist > DEFLATE_TOO_FAR))) {
         return 0;
     }
-    if((header->width < 1) || (header->width >512)) {
-        fprintf(stderr, "invalid frame width.\n");
+    return best;
+}
+
+static inline int deflate_push(struct deflate_t *z, const struct deflate_level_t *level, int value, int dist, int len) {
+    z->tokens[z->token_count].value = value;
+    z->tokens[z->token_count].dist = dist;
+    z->token_count++;
+    z->block_end += len;
+    if(z->token_count == DEFLATE_BLOCK_TOKENS) {
+        return deflate_flush_block(z, level, 0);
+    }
+    return 1;
+}
+
+// Compress the buffered input. Unless finish is set, DEFLATE_LOOKAHEAD bytes are kept for the next call so that
+// matches are never cut by the end of the buffered data.
+static int deflate_compress(struct deflate_t *z, int finish) {
+    const struct deflate_level_t *level = z->level;
+    size_t n = z->data_len;
+    size_t limit = finish ? n : ((n > DEFLATE_LOOKAHEAD) ? (n - DEFLATE_LOOKAHEAD) : 0);
+    size_t insert_end = (n >= DEFLATE_MIN_MATCH) ? (n - DEFLATE_MIN_MATCH + 1) : 0;
+    size_t pos = z->pos;
+    int dist = 0;
+
+    if(level->lazy == 0) {
+        while(pos < limit) {
+            int len = 0;
+            if((pos + DEFLATE_MIN_MATCH) <= n) {
+                len = deflate_longest_match(z, pos, level, 0, &dist);
+                deflate_insert(z, pos);
+            }
+            if(len) {
+                if(!deflate_push(z, level, len, dist, len)) {
+                    return 0;
+                }
+                size_t end = pos + len;
+                for(pos++; (pos < end) && (pos < insert_end); pos++) {
+                    deflate_insert(z, pos);
+                }
+                pos = end;
+            }
+            else {
+                if(!deflate_push(z, level, z->data[pos], 0, 1)) {
+                    return 0;
+                }
+                pos++;
+            }
+        }
+    }
+    else {
+        // The match (or literal) found at the previous position is pending until we know if the current
+        // position gives a longer match.
+        int prev_len = z->prev_len, prev_dist = z->prev_dist;
+        int available = z->available;
+        while(pos < limit) {
+            int len = 0;
+            if((pos + DEFLATE_MIN_MATCH) <= n) {
+                if(prev_len < level->lazy) {
+                    len = deflate_longest_match(z, pos, level, prev_len, &dist);
+                }
+                deflate_insert(z, pos);
+            }
+            if(available && (prev_len >= DEFLATE_MIN_MATCH) && (len <= prev_len)) {
+                // The match found at the previous position is better.
+                if(!deflate_push(z, level, prev_len, prev_dist, prev_len)) {
+                    return 0;
+                }
+                size_t end = pos - 1 + prev_len;
+                for(pos++; (pos < end) && (pos < insert_end); pos++) {
+                    deflate_insert(z, pos);
+                }
+                pos = end;
+                available = 0;
+                prev_len = 0;
+            }
+            else {
+                if(available) {
+                    if(!deflate_push(z, level, z->data[pos-1], 0, 1)) {
+                        return 0;
+                    }
+                }
+                prev_len = len;
+                prev_dist = dist;
+                available = 1;
+                pos++;
+            }
+        }
+        if(finish && available) {
+            if(prev_len >= DEFLATE_MIN_MATCH) {
+                if(!deflate_push(z, level, prev_len, prev_dist, prev_len)) {
+                    return 0;
+                }
+            }
+            else if(!deflate_push(z, level, z->data[n-1], 0, 1)) {
+                return 0;
+            }
+            available = 0;
+        }
+        z->prev_len = prev_len;
+        z->prev_dist = prev_dist;
+        z->available = available;
+    }
+    z->pos = pos;
+    return finish ? deflate_flush_block(z, level, 1) : 1;
+}
+
+// Discard the oldest half of the streaming window. The pending block is flushed first as stored blocks need
+// its raw data.
+static int deflate_slide(struct deflate_t *z) {
+    if(z->token_count && !deflate_flush_block(z, z->level, 0)) {
         return 0;
     }
-    n_read = fread(&header->height, 1, 2, in);
-    if(n_read != 2) {
-        fprintf(stderr, "failed to read frame height.\n");
-        return 0;
+    memmove(z->window, z->window + DEFLATE_WINDOW_SIZE, z->data_len - DEFLATE_WINDOW_SIZE);
+    z->data_len -= DEFLATE_WINDOW_SIZE;
+    z->pos -= DEFLATE_WINDOW_SIZE;
+    z->block_start -= DEFLATE_WINDOW_SIZE;
+    z->block_end -= DEFLATE_WINDOW_SIZE;
+    for(int i=0; i<(1<<DEFLATE_HASH_BITS); i++) {
+        z->head[i] = (z->head[i] >= DEFLATE_WINDOW_SIZE) ? (z->head[i] - DEFLATE_WINDOW_SIZE) : -1;
+    }
+    for(int i=0; i<DEFLATE_WINDOW_SIZE; i++) {
+        z->prev[i] = (z->prev[i] >= DEFLATE_WINDOW_SIZE) ? (z->prev[i] - DEFLATE_WINDOW_SIZE) : -1;
+    }
+    return 1;
+}
+
+static void deflate_close(struct deflate_t *z) {
+    if(z) {
+        free(z->out);
+        free(z->window);
+        free(z->head);
+        free(z->prev);
+        free(z);
+    }
+}
+
+// Create a compressor and write the zlib header.
+// If streaming is set, input is pushed with deflate_write and buffered in a 2*DEFLATE_WINDOW_SIZE window.
+// Otherwise the whole input must be set in data/data_len before calling deflate_finish.
+static struct deflate_t* deflate_open(int quality, int streaming, size_t out_capacity) {
+    static const uint8_t flags[4] = { 0x01, 0x5e, 0x9c, 0xda };
+    struct deflate_t *z;
+
+    if(quality < 0) {
+        quality = 0;
+    }
+    else if(quality > 9) {
+        quality = 9;
+    }
+
+    deflate_init_tables();
+
+    z = (struct deflate_t*)calloc(1, sizeof(struct deflate_t));
+    if(z == NULL) {
+        return NULL;
+    }
+    z->level = &g_deflate_levels[quality];
+    z->adler = 1;
+    z->out_capacity = out_capacity + 64;
+    z->out = (uint8_t*)malloc(z->out_capacity);
+    if(z->out == NULL) {
+        deflate_close(z);
+        return NULL;
+    }
+    if(streaming) {
+        z->window = (uint8_t*)malloc(DEFLATE_BUFFER_SIZE);
+        if(z->window == NULL) {
+            deflate_close(z);
+            return NULL;
+        }
+        z->data = z->window;
+    }
+    if(z->level->chain) {
+        z->head = (int32_t*)malloc(sizeof(int32_t) << DEFLATE_HASH_BITS);
+        z->prev = (int32_t*)malloc(sizeof(int32_t) * DEFLATE_WINDOW_SIZE);
+        if((z->head == NULL) || (z->prev == NULL)) {
+            deflate_close(z);
+            return NULL;
+        }
+        memset(z->head, 0xff, sizeof(int32_t) << DEFLATE_HASH_BITS);
+    }
+
+    // zlib header (32K window, deflate), the FLEVEL bits reflect the compression mode.
+    z->out[z->out_len++] = 0x78;
+    z->out[z->out_len++] = flags[(quality < 2) ? 0 : (quality < 6) ? 1 : (quality < 9) ? 2 : 3];
+    return z;
+}
+
+// Append data to a streaming compressor. Compressed data is appended to z->out, which can be consumed
+// (and z->out_len reset) between calls.
+static int deflate_write(struct deflate_t *z, const uint8_t *data, size_t len) {
+    z->adler = adler32(z->adler, data, len);
+    while(len) {
+        if(z->data_len == DEFLATE_BUFFER_SIZE) {
+            if(z->level->chain == 0) {
+                if(!deflate_write_stored(z, z->window, z->data_len, 0)) {
+                    return 0;
+                }
+                z->data_len = 0;
+            }
+            else if(!deflate_compress(z, 0) || !deflate_slide(z)) {
+                return 0;
+            }
+        }
+        size_t n = DEFLATE_BUFFER_SIZE - z->data_len;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(z->window + z->data_len, data, n);
+        z->data_len += n;
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Compress the remaining data, and write the final block and the Adler-32 checksum.
+static int deflate_finish(struct deflate_t *z) {
+    int ok;
+    if(z->level->chain == 0) {
+        ok = deflate_write_stored(z, z->data, z->data_len, 1);
+    }
+    else {
+        ok = deflate_compress(z, 1);
+    }
+    if(ok) {
+        deflate_align(z);
+        ok = deflate_reserve(z, 4);
+    }
+    if(ok) {
+        z->out[z->out_len++] = z->adler >> 24;
+        z->out[z->out_len++] = z->adler >> 16;
+        z->out[z->out_len++] = z->adler >> 8;
+        z->out[z->out_len++] = z->adler;
+    }
+    return ok;
+}
+
+unsigned char* huvideo_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality) {
+    struct deflate_t *z;
+    uint8_t *out;
+
+    z = deflate_open(quality, 0, data_len/2);
+    if(z == NULL) {
+        return NULL;
+    }
+    z->data = data;
+    z->data_len = data_len;
+    z->adler = adler32(1, data, data_len);
+    if(!deflate_finish(z)) {
+        deflate_close(z);
+        return NULL;
+    }
+    out = z->out;
+    *out_len = (int)z->out_len;
+    z->out = NULL;
+    deflate_close(z);
+    return out;
+}
+
+/*
+ * Run statistics (--stats) and timeline (--trace).
+ * The time spent in each stage is accumulated whenever the current stage changes. Stages nest: for example
+ * the output files written by an encoder are accounted to the write stage, and the encoder resumes afterwards.
+ * Counters are always updated, the clocks are only read when --stats or --trace is used.
+ */
+enum Stage {
+    STAGE_OTHER = 0,        // setup, manifest and journal.
+    STAGE_SCAN,             // header probes.
+    STAGE_READ,             // image sectors.
+    STAGE_HASH,             // cache key and duplicate frames detection.
+    STAGE_AUDIO,            // adpcm decoding.
+    STAGE_CONVERT,          // planar data to RGB8 or palette indices.
+    STAGE_ENCODE,           // output formats.
+    STAGE_WRITE,            // output files creation and writes.
+    STAGE_COUNT
+};
+
+static const char *g_stage_name[STAGE_COUNT] = {
+    "other", "scan", "read", "hash", "audio", "convert", "encode", "write"
+};
+
+struct stats_video_t {
+    int32_t index;
+    int64_t frames;
+    uint64_t wall;
+};
+
+struct stats_t {
+    int enabled;
+    const char *json;       // JSON report filename (optional).
+    int stage;
+    uint64_t wall_start;    // beginning of the current stage.
+    uint64_t cpu_start;
+    uint64_t wall[STAGE_COUNT];
+    uint64_t cpu[STAGE_COUNT];
+    uint64_t reads;         // image accesses.
+    uint64_t seeks;
+    uint64_t bytes_read;
+    uint64_t image_size;
+    uint64_t headers_probed;
+    uint64_t headers_found;
+    uint64_t files;         // output files.
+    uint64_t links;
+    uint64_t bytes_written;
+    struct stats_video_t *video;
+    int video_count;
+    int video_capacity;
+};
+
+static struct stats_t g_stats;
+
+static inline uint64_t stats_clock(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Every stage span (except "other") and every extracted video is recorded in a ring buffer written as a
+// Chrome trace-event file at exit. The oldest events are overwritten when the buffer is full.
+#define TRACE_CAPACITY (1 << 18)
+
+struct trace_event_t {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    int32_t video;
+    int32_t frame;
+};
+
+// There is one buffer per thread, and the decoder has a single thread.
+struct trace_t {
+    const char *filename;
+    struct trace_event_t *event;
+    uint64_t count;         // events recorded since the beginning.
+    uint64_t origin;
+    int pid;
+    int tid;
+    int32_t video;          // current video and frame.
+    int32_t frame;
+    int32_t span_video;     // video and frame when the current stage was entered.
+    int32_t span_frame;
+};
+
+static struct trace_t g_trace = { NULL, NULL, 0, 0, 0, 0, -1, -1, -1, -1 };
+
+static inline void trace_span(const char *name, uint64_t start, uint64_t end, int32_t video, int32_t frame) {
+    struct trace_event_t *event;
+    if(g_trace.event == NULL) {
+        return;
+    }
+    event = &g_trace.event[g_trace.count++ % TRACE_CAPACITY];
+    event->name = name;
+    event->start = start;
+    event->end = end;
+    event->video = video;
+    event->frame = frame;
+}
+
+// Enter a stage. Returns the current one so that it can be restored.
+static inline int stats_stage(int stage) {
+    int previous = g_stats.stage;
+    if((g_stats.enabled || g_trace.event) && (stage != previous)) {
+        uint64_t wall = stats_clock(CLOCK_MONOTONIC);
+        if(g_stats.enabled) {
+            uint64_t cpu = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+            g_stats.wall[previous] += wall - g_stats.wall_start;
+            g_stats.cpu[previous] += cpu - g_stats.cpu_start;
+            g_stats.cpu_start = cpu;
+        }
+        if(previous != STAGE_OTHER) {
+            trace_span(g_stage_name[previous], g_stats.wall_start, wall, g_trace.span_video, g_trace.span_frame);
+        }
+        g_stats.wall_start = wall;
+        g_trace.span_video = g_trace.video;
+        g_trace.span_frame = g_trace.frame;
+    }
+    g_stats.stage = stage;
+    return previous;
+}
+
+static void stats_start() {
+    g_stats.stage = STAGE_OTHER;
+    g_stats.wall_start = stats_clock(CLOCK_MONOTONIC);
+    g_stats.cpu_start = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+    if(g_trace.filename) {
+        g_trace.event = (struct trace_event_t*)malloc(TRACE_CAPACITY * sizeof(struct trace_event_t));
+        if(g_trace.event == NULL) {
+            fprintf(stderr, "failed to allocate trace buffer.\n");
+        }
+        g_trace.origin = g_stats.wall_start;
+        g_trace.pid = getpid();
+        g_trace.tid = (int)syscall(SYS_gettid);
+    }
+}
+
+// Write the trace buffer (--trace). Times are in microseconds since the beginning of the run.
+static int trace_save() {
+    uint64_t first;
+    FILE *out;
+
+    if(g_trace.event == NULL) {
+        return g_trace.filename == NULL;
+    }
+    stats_stage(STAGE_OTHER);
+    out = fopen(g_trace.filename, "wb");
+    if(out == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", g_trace.filename, strerror(errno));
+        return 0;
+    }
+    fprintf(out, "{\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"huvideo_decode\"}},\n", g_trace.pid, g_trace.tid);
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"main\"}}", g_trace.pid, g_trace.tid);
+    first = (g_trace.count > TRACE_CAPACITY) ? (g_trace.count - TRACE_CAPACITY) : 0;
+    for(uint64_t i=first; i<g_trace.count; i++) {
+        const struct trace_event_t *event = &g_trace.event[i % TRACE_CAPACITY];
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"huvideo\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                event->name, (event->start - g_trace.origin) / 1e3, (event->end - event->start) / 1e3, g_trace.pid, g_trace.tid);
+        if(event->video >= 0) {
+            fprintf(out, ",\"args\":{\"video\":%d", event->video);
+            if(event->frame >= 0) {
+                fprintf(out, ",\"frame\":%d", event->frame);
+            }
+            fprintf(out, "}");
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"events\":%llu,\"dropped\":%llu}}\n",
+            (unsigned long long)g_trace.count, (unsigned long long)first);
+    free(g_trace.event);
+    g_trace.event = NULL;
+    if(fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", g_trace.filename, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+static void stats_add_video(int32_t index, int64_t frames, uint64_t wall) {
+    if(g_stats.video_count >= g_stats.video_capacity) {
+        int capacity = g_stats.video_capacity ? (2 * g_stats.video_capacity) : 64;
+        struct stats_video_t *video = (struct stats_video_t*)realloc(g_stats.video, capacity * sizeof(struct stats_video_t));
+        if(video == NULL) {
+            return;
+        }
+        g_stats.video = video;
+        g_stats.video_capacity = capacity;
+    }
+    g_stats.video[g_stats.video_count].index = index;
+    g_stats.video[g_stats.video_count].frames = frames;
+    g_stats.video[g_stats.video_count].wall = wall;
+    g_stats.video_count++;
+}
+
+// Image access pattern (--io-report).
+// Reads, seek distances and sequential runs (reads starting where the previous one ended) are counted in
+// power of 2 buckets: bucket 0 holds 0, and bucket b the values in [2^(b-1), 2^b).
+#define IO_BUCKETS 48
+
+struct io_t {
+    int enabled;
+    int64_t position;                   // offset of the next read.
+    int64_t lowest;                     // lowest and highest offsets read.
+    int64_t highest;
+    uint64_t short_reads;
+    uint64_t read_count[IO_BUCKETS];    // by size.
+    uint64_t read_bytes[IO_BUCKETS];
+    uint64_t seek_none;                 // seeks to the current position.
+    uint64_t seek_forward[IO_BUCKETS];  // by distance.
+    uint64_t seek_backward[IO_BUCKETS];
+    uint64_t run_count[IO_BUCKETS];     // by length in bytes.
+    uint64_t runs;
+    uint64_t run_reads;                 // current run.
+    int64_t run_start;
+    uint64_t longest_run;
+};
+
+static struct io_t g_io = { .lowest = INT64_MAX, .highest = -1 };
+
+static inline int io_bucket(uint64_t value) {
+    int b = value ? (64 - __builtin_clzll(value)) : 0;
+    return (b < IO_BUCKETS) ? b : (IO_BUCKETS-1);
+}
+
+static void io_end_run() {
+    uint64_t len;
+    if(g_io.run_reads == 0) {
+        return;
+    }
+    len = g_io.position - g_io.run_start;
+    g_io.run_count[io_bucket(len)]++;
+    g_io.runs++;
+    if(len > g_io.longest_run) {
+        g_io.longest_run = len;
+    }
+    g_io.run_reads = 0;
+}
+
+static void io_seek(int64_t offset) {
+    int64_t distance = offset - g_io.position;
+    if(distance == 0) {
+        g_io.seek_none++;
+        return;
+    }
+    if(distance > 0) {
+        g_io.seek_forward[io_bucket(distance)]++;
+    }
+    else {
+        g_io.seek_backward[io_bucket(-distance)]++;
+    }
+    io_end_run();
+    g_io.position = offset;
+}
+
+static void io_read(size_t size, size_t n_read) {
+    int b = io_bucket(size);
+    g_io.read_count[b]++;
+    g_io.read_bytes[b] += n_read;
+    g_io.short_reads += (n_read < size);
+    if(n_read == 0) {
+        return;
+    }
+    if(g_io.run_reads == 0) {
+        g_io.run_start = g_io.position;
+    }
+    g_io.run_reads++;
+    if(g_io.position < g_io.lowest) {
+        g_io.lowest = g_io.position;
+    }
+    g_io.position += n_read;
+    if(g_io.position > g_io.highest) {
+        g_io.highest = g_io.position;
+    }
+}
+
+static void io_print_histogram(const char *title, const char *unit, const uint64_t *count, const uint64_t *bytes) {
+    fprintf(stderr, "  %s:\n", title);
+    for(int b=0; b<IO_BUCKETS; b++) {
+        if(count[b] == 0) {
+            continue;
+        }
+        if(b == 0) {
+            fprintf(stderr, "    %24s", "0");
+        }
+        else {
+            fprintf(stderr, "    [%10llu, %10llu)", 1ULL << (b-1), 1ULL << b);
+        }
+        fprintf(stderr, " %10llu %s", (unsigned long long)count[b], unit);
+        if(bytes) {
+            fprintf(stderr, " %14llu bytes", (unsigned long long)bytes[b]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+// Print the access pattern on the standard error.
+static void io_report() {
+    uint64_t forward = 0, backward = 0;
+    unsigned long long syscr = 0, rchar = 0;
+    char line[64];
+    FILE *proc;
+
+    io_end_run();
+    for(int b=0; b<IO_BUCKETS; b++) {
+        forward += g_io.seek_forward[b];
+        backward += g_io.seek_backward[b];
+    }
+    fprintf(stderr, "image access pattern:\n");
+    fprintf(stderr, "  reads: %llu calls, %llu bytes (%.1f bytes/call), %llu short\n",
+            (unsigned long long)g_stats.reads, (unsigned long long)g_stats.bytes_read,
+            g_stats.reads ? ((double)g_stats.bytes_read / g_stats.reads) : 0.0, (unsigned long long)g_io.short_reads);
+    if(g_io.highest >= 0) {
+        fprintf(stderr, "  offsets: 0x%llx to 0x%llx\n", (unsigned long long)g_io.lowest, (unsigned long long)g_io.highest);
+    }
+    // Every byte of the image is read at most once.
+    fprintf(stderr, "  image: %llu bytes, %s\n", (unsigned long long)g_stats.image_size,
+            (g_stats.bytes_read <= g_stats.image_size) ? "read at most once" : "WARNING: some bytes were read more than once");
+    io_print_histogram("read sizes (bytes)", "reads", g_io.read_count, g_io.read_bytes);
+    fprintf(stderr, "  seeks: %llu (%llu to the current position, %llu forward, %llu backward)\n",
+            (unsigned long long)g_stats.seeks, (unsigned long long)g_io.seek_none, (unsigned long long)forward, (unsigned long long)backward);
+    io_print_histogram("forward seek distances (bytes)", "seeks", g_io.seek_forward, NULL);
+    io_print_histogram("backward seek distances (bytes)", "seeks", g_io.seek_backward, NULL);
+    fprintf(stderr, "  sequential runs: %llu, %.1f reads and %.1f bytes per run, longest %llu bytes\n", (unsigned long long)g_io.runs,
+            g_io.runs ? ((double)g_stats.reads / g_io.runs) : 0.0, g_io.runs ? ((double)g_stats.bytes_read / g_io.runs) : 0.0,
+            (unsigned long long)g_io.longest_run);
+    io_print_histogram("run lengths (bytes)", "runs", g_io.run_count, NULL);
+
+    // System calls issued by the standard library (the whole process, not only the image).
+    proc = fopen("/proc/self/io", "rb");
+    if(proc) {
+        while(fgets(line, sizeof(line), proc)) {
+            sscanf(line, "syscr: %llu", &syscr);
+            sscanf(line, "rchar: %llu", &rchar);
+        }
+        fclose(proc);
+        fprintf(stderr, "  process: %llu read system calls, %llu bytes (%.1f bytes/call)\n", syscr, rchar,
+                syscr ? ((double)rchar / syscr) : 0.0);
+    }
+}
+
+// Image accesses.
+static inline int image_seek(FILE *in, int64_t offset) {
+    g_stats.seeks++;
+    if(g_io.enabled) {
+        io_seek(offset);
+    }
+    return fseek(in, offset, SEEK_SET);
+}
+
+static inline size_t image_read(void *data, size_t size, FILE *in) {
+    size_t n_read = fread(data, 1, size, in);
+    g_stats.reads++;
+    g_stats.bytes_read += n_read;
+    if(g_io.enabled) {
+        io_read(size, n_read);
+    }
+    return n_read;
+}
+
+static double stats_fps(int64_t frames, uint64_t wall) {
+    return wall ? (frames * 1e9 / wall) : 0.0;
+}
+
+// Print the report on the standard error, and write it to the JSON file if any.
+static int stats_report(int64_t frames, int64_t duplicates, int64_t tile_lookups, int64_t tile_hits) {
+    struct rusage usage;
+    uint64_t wall = 0, cpu = 0;
+    double tile_rate = tile_lookups ? (100.0 * tile_hits / tile_lookups) : 0.0;
+    long peak_rss;
+    FILE *out;
+
+    stats_stage(STAGE_OTHER);
+    for(int i=0; i<STAGE_COUNT; i++) {
+        wall += g_stats.wall[i];
+        cpu += g_stats.cpu[i];
+    }
+    peak_rss = (getrusage(RUSAGE_SELF, &usage) == 0) ? usage.ru_maxrss : 0;    // kilobytes
+
+    fprintf(stderr, "%-8s %10s %10s\n", "stage", "wall (s)", "cpu (s)");
+    for(int i=0; i<STAGE_COUNT; i++) {
+        fprintf(stderr, "%-8s %10.3f %10.3f\n", g_stage_name[i], g_stats.wall[i] / 1e9, g_stats.cpu[i] / 1e9);
+    }
+    fprintf(stderr, "%-8s %10.3f %10.3f\n", "total", wall / 1e9, cpu / 1e9);
+    fprintf(stderr, "image: %llu bytes, %llu reads, %llu seeks, %llu bytes read\n", (unsigned long long)g_stats.image_size,
+            (unsigned long long)g_stats.reads, (unsigned long long)g_stats.seeks, (unsigned long long)g_stats.bytes_read);
+    fprintf(stderr, "headers: %llu probed, %llu found\n", (unsigned long long)g_stats.headers_probed, (unsigned long long)g_stats.headers_found);
+    fprintf(stderr, "output: %lld frames, %llu files, %llu links, %llu bytes written\n", (long long)frames,
+            (unsigned long long)g_stats.files, (unsigned long long)g_stats.links, (unsigned long long)g_stats.bytes_written);
+    fprintf(stderr, "duplicate frames: %lld\n", (long long)duplicates);
+    fprintf(stderr, "tile cache: %lld hits out of %lld tiles (%.1f%%)\n", (long long)tile_hits, (long long)tile_lookups, tile_rate);
+    for(int i=0; i<g_stats.video_count; i++) {
+        struct stats_video_t *video = &g_stats.video[i];
+        fprintf(stderr, "video %04d: %lld frames in %.3f s (%.1f frames/s)\n", video->index, (long long)video->frames,
+                video->wall / 1e9, stats_fps(video->frames, video->wall));
+    }
+    fprintf(stderr, "run: %lld frames in %.3f s (%.1f frames/s), peak RSS %ld KB\n", (long long)frames, wall / 1e9,
+            stats_fps(frames, wall), peak_rss);
+
+    if(g_stats.json == NULL) {
+        return 1;
+    }
+    out = fopen(g_stats.json, "wb");
+    if(out == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", g_stats.json, strerror(errno));
+        return 0;
+    }
+    fprintf(out, "{\n  \"stages\": {");
+    for(int i=0; i<STAGE_COUNT; i++) {
+        fprintf(out, "%s\n    \"%s\": { \"wall\": %.6f, \"cpu\": %.6f }", i ? "," : "", g_stage_name[i], g_stats.wall[i] / 1e9, g_stats.cpu[i] / 1e9);
+    }
+    fprintf(out, "\n  },\n");
+    fprintf(out, "  \"wall\": %.6f,\n  \"cpu\": %.6f,\n", wall / 1e9, cpu / 1e9);
+    fprintf(out, "  \"image\": { \"size\": %llu, \"reads\": %llu, \"seeks\": %llu, \"bytes_read\": %llu },\n",
+            (unsigned long long)g_stats.image_size, (unsigned long long)g_stats.reads, (unsigned long long)g_stats.seeks, (unsigned long long)g_stats.bytes_read);
+    fprintf(out, "  \"headers\": { \"probed\": %llu, \"found\": %llu },\n",
+            (unsigned long long)g_stats.headers_probed, (unsigned long long)g_stats.headers_found);
+    fprintf(out, "  \"output\": { \"frames\": %lld, \"files\": %llu, \"links\": %llu, \"bytes_written\": %llu },\n", (long long)frames,
+            (unsigned long long)g_stats.files, (unsigned long long)g_stats.links, (unsigned long long)g_stats.bytes_written);
+    fprintf(out, "  \"duplicate_frames\": %lld,\n", (long long)duplicates);
+    fprintf(out, "  \"tile_cache\": { \"lookups\": %lld, \"hits\": %lld, \"hit_rate\": %.3f },\n",
+            (long long)tile_lookups, (long long)tile_hits, tile_rate / 100.0);
+    fprintf(out, "  \"peak_rss_kb\": %ld,\n  \"frames_per_s\": %.3f,\n  \"videos\": [", peak_rss, stats_fps(frames, wall));
+    for(int i=0; i<g_stats.video_count; i++) {
+        struct stats_video_t *video = &g_stats.video[i];
+        fprintf(out, "%s\n    { \"index\": %d, \"frames\": %lld, \"wall\": %.6f, \"frames_per_s\": %.3f }", i ? "," : "",
+                video->index, (long long)video->frames, video->wall / 1e9, stats_fps(video->frames, video->wall));
+    }
+    fprintf(out, "%s]\n}\n", g_stats.video_count ? "\n  " : "");
+    if(fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", g_stats.json, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+// Size of a HuVideo header.
+#define HEADER_SIZE 32
+
+// Copy size bytes of the header buffer at *pos to field.
+static inline int header_get(void *field, size_t size, const uint8_t *data, size_t len, size_t *pos) {
+    if((*pos + size) > len) {
+        return 0;
+    }
+    memcpy(field, data + *pos, size);
+    *pos += size;
+    return 1;
+}
+
+/* This part is based upon the source code found in Power Golf 2 and Beyond Shadowgate. */
+// Decode the header at the beginning of data (len bytes are available, the image may end before the header).
+int decode_header(const uint8_t *data, size_t len, struct header_t *header) {
+    static const char magic[16] = "HuVIDEO         ";
+    
+    size_t pos = 0;
+    uint8_t buffer[16];
+
+    if(!header_get(buffer, 16, data, len, &pos)) {
+        fprintf(stderr, "failed to read header ID.\n");
+        return 0;
+    }
+    if(memcmp(buffer, magic, 16)) {
+        fprintf(stderr, "invalid header ID.\n");
+        return 0;
+    }
+    if(!header_get(&header->frames, 2, data, len, &pos)) {
+        fprintf(stderr, "failed to read frame count.\n");
+        return 0;
+    }
+    if(!header_get(&header->width, 2, data, len, &pos)) {
+        fprintf(stderr, "failed to read frame width.\n");
+        return 0;
+    }
+    if((header->width < 1) || (header->width >512)) {
+        fprintf(stderr, "invalid frame width.\n");
+        return 0;
+    }
+    if(!header_get(&header->height, 2, data, len, &pos)) {
+        fprintf(stderr, "failed to read frame height.\n");
+        return 0;
+    }
+    if((header->height < 1) || (header->height >512)) {
+        fprintf(stderr, "invalid frame height.\n");
+        return 0;
+    }
+    if(!header_get(&header->flag, 1, data, len, &pos)) {
+        fprintf(stderr, "failed to read palette flag.\n");
+        return 0;
+    }
+    if(!header_get(&header->format, 1, data, len, &pos)) {
+        fprintf(stderr, "failed to read format.\n");
+        return 0;
+    }
+    if(header->format > 1) {
+        fprintf(stderr, "invalid format.\n");
+        return 0;
+    }
+    if(!header_get(&header->adpcm_len, 2, data, len, &pos)) {
+        fprintf(stderr, "failed to read adpcm length.\n");
+        return 0;
+    }
+    // The next 6 bytes are unknown.
+    if(!header_get(&header->unknown, 6, data, len, &pos)) {
+        fprintf(stderr, "failed to read the header end.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Cache of converted BG tiles. Tiles repeat a lot within and across frames (backgrounds, borders, blank
+// areas), so the RGB block of a tile is looked up using its 32 bytes of planar data before converting it.
+// The cache is direct mapped, with 2^TILE_CACHE_BITS entries indexed by a hash of the tile data.
+#define TILE_CACHE_BITS 10
+
+struct tile_cache_entry_t {
+    uint8_t tile[32];
+    uint8_t rgb[8*8*3];
+};
+
+struct tile_cache_t {
+    uint8_t palette[16*3];      // palette used by the cached blocks.
+    uint8_t valid[1 << TILE_CACHE_BITS];
+    struct tile_cache_entry_t entry[1 << TILE_CACHE_BITS];
+    uint64_t lookups;
+    uint64_t hits;
+};
+
+// Convert a PCE planar tile to a 8x8 RGB8 block.
+static inline void tile_block_to_rgb8(uint8_t *out_tile, uint32_t rgb_line_stride, const uint8_t *pce_tile, const uint8_t *palette) {
+    for(int y=0; y<8; y++, pce_tile+=2, out_tile+=rgb_line_stride) {
+        uint8_t b0 = pce_tile[0];
+        uint8_t b1 = pce_tile[1];
+        uint8_t b2 = pce_tile[16];
+        uint8_t b3 = pce_tile[17];
+
+        uint8_t *out = out_tile + 7*3;
+        for(int x=0; x<8; x++, out-=3) {
+            uint8_t index = (b0&1) | ((b1&1)<<1) | ((b2&1)<<2) | ((b3&1)<<3);
+            out[0] = palette[3*index];
+            out[1] = palette[3*index+1];
+            out[2] = palette[3*index+2];
+
+            b0 >>= 1;
+            b1 >>= 1;
+            b2 >>= 1;
+            b3 >>= 1;
+        }
+    }
+}
+
+static inline uint32_t tile_hash(const uint8_t *pce_tile) {
+    uint64_t v[4];
+    memcpy(v, pce_tile, 32);
+    uint64_t h = (v[0] * 0x9e3779b97f4a7c15ULL) ^ (v[1] * 0xc2b2ae3d27d4eb4fULL)
+               ^ (v[2] * 0x165667b19e3779f9ULL) ^ (v[3] * 0xd6e8feb86659fd93ULL);
+    return (uint32_t)(h >> (64 - TILE_CACHE_BITS));
+}
+
+// Convert PCE tile vram data to RGB8.
+// cache may be NULL.
+void tile_to_rgb8(uint8_t *rgb, uint8_t *vram, uint8_t *palette, struct header_t *header, struct tile_cache_t *cache) {
+    uint16_t tile_w = header->width / 8;
+    uint16_t tile_h = header->height / 8;
+    uint32_t rgb_line_stride = header->width * 3;
+
+    if(cache && memcmp(cache->palette, palette, 16*3)) {
+        // The cached blocks were converted with another palette.
+        memset(cache->valid, 0, sizeof(cache->valid));
+        memcpy(cache->palette, palette, 16*3);
+    }
+
+    for(int j=0; j<tile_h; j++) {
+        for(int i=0; i<tile_w; i++) {
+            uint8_t *pce_tile = vram + (i + j*tile_w) * 32;
+            uint8_t *out_tile = rgb + (i + j*header->width) * 8 * 3;
+            if(cache == NULL) {
+                tile_block_to_rgb8(out_tile, rgb_line_stride, pce_tile, palette);
+                continue;
+            }
+
+            uint32_t h = tile_hash(pce_tile);
+            struct tile_cache_entry_t *entry = &cache->entry[h];
+            cache->lookups++;
+            if(cache->valid[h] && !memcmp(entry->tile, pce_tile, 32)) {
+                cache->hits++;
+            }
+            else {
+                memcpy(entry->tile, pce_tile, 32);
+                tile_block_to_rgb8(entry->rgb, 8*3, pce_tile, palette);
+                cache->valid[h] = 1;
+            }
+            for(int y=0; y<8; y++, out_tile+=rgb_line_stride) {
+                memcpy(out_tile, entry->rgb + y*8*3, 8*3);
+            }
+        }
+    }
+}
+
+// Convert PCE sprite vram data to RGB8 (only supports 32*64 sprite size).
+void sprite_to_rgb8(uint8_t *rgb, uint8_t *vram, uint8_t *palette, struct header_t *header) {
+    uint16_t sprite_w = header->width / 16;
+    uint16_t sprite_h = header->height / 16;
+    uint32_t rgb_line_stride = header->width * 3;
+
+    for(int j=0; j<sprite_h; j++) {
+        for(int i=0; i<sprite_w; i++) {
+            uint16_t *pce_sprite = (uint16_t*)(vram + (i + j*sprite_w) * 0x80);
+            
+            int u = ((i & 1) * 16) + (j * 32);
+            int v = (i >> 1) * 16;
+            uint8_t *out_sprite = rgb + (u + v*header->width) * 3;
+            for(int y=0; y<16; y++, pce_sprite+=1, out_sprite+=rgb_line_stride) {
+                uint16_t w0 = pce_sprite[0];
+                uint16_t w1 = pce_sprite[16];
+                uint16_t w2 = pce_sprite[32];
+                uint16_t w3 = pce_sprite[48];
+
+                uint8_t *out = out_sprite + 15*3;
+                for(int x=0; x<16; x++, out-=3) {
+                    uint8_t index = (w0&1) | ((w1&1)<<1) | ((w2&1)<<2) | ((w3&1)<<3);
+                    out[0] = palette[3*index];
+                    out[1] = palette[3*index+1];
+                    out[2] = palette[3*index+2];
+
+                    w0 >>= 1;
+                    w1 >>= 1;
+                    w2 >>= 1;
+                    w3 >>= 1;
+                }
+            }
+        }
+    }
+}
+
+// Convert PCE tile vram data to palette indices (one byte per pixel).
+void tile_to_index8(uint8_t *indexed, uint8_t *vram, struct header_t *header) {
+    uint16_t tile_w = header->width / 8;
+    uint16_t tile_h = header->height / 8;
+
+    for(int j=0; j<tile_h; j++) {
+        for(int i=0; i<tile_w; i++) {
+            uint8_t *pce_tile = vram + (i + j*tile_w) * 32;
+            uint8_t *out_tile = indexed + (i + j*header->width) * 8;
+            for(int y=0; y<8; y++, pce_tile+=2, out_tile+=header->width) {
+                uint8_t b0 = pce_tile[0];
+                uint8_t b1 = pce_tile[1];
+                uint8_t b2 = pce_tile[16];
+                uint8_t b3 = pce_tile[17];
+                for(int x=7; x>=0; x--) {
+                    out_tile[x] = (b0&1) | ((b1&1)<<1) | ((b2&1)<<2) | ((b3&1)<<3);
+                    b0 >>= 1;
+                    b1 >>= 1;
+                    b2 >>= 1;
+                    b3 >>= 1;
+                }
+            }
+        }
+    }
+}
+
+// Convert PCE sprite vram data to palette indices (only supports 32*64 sprite size).
+void sprite_to_index8(uint8_t *indexed, uint8_t *vram, struct header_t *header) {
+    uint16_t sprite_w = header->width / 16;
+    uint16_t sprite_h = header->height / 16;
+
+    for(int j=0; j<sprite_h; j++) {
+        for(int i=0; i<sprite_w; i++) {
+            uint16_t *pce_sprite = (uint16_t*)(vram + (i + j*sprite_w) * 0x80);
+
+            int u = ((i & 1) * 16) + (j * 32);
+            int v = (i >> 1) * 16;
+            uint8_t *out_sprite = indexed + u + v*header->width;
+            for(int y=0; y<16; y++, pce_sprite+=1, out_sprite+=header->width) {
+                uint16_t w0 = pce_sprite[0];
+                uint16_t w1 = pce_sprite[16];
+                uint16_t w2 = pce_sprite[32];
+                uint16_t w3 = pce_sprite[48];
+                for(int x=15; x>=0; x--) {
+                    out_sprite[x] = (w0&1) | ((w1&1)<<1) | ((w2&1)<<2) | ((w3&1)<<3);
+                    w0 >>= 1;
+                    w1 >>= 1;
+                    w2 >>= 1;
+                    w3 >>= 1;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Conversion kernels benchmark (--bench-kernels).
+ * Every kernel converts a set of random frames for each frame size, after a few warmup runs. The best and
+ * average times are reported in cycles (TSC) per pixel. The output of every run of a kernel is compared with
+ * the one of its reference kernel. Palette indices are compared through the palette.
+ */
+#define BENCH_WARMUP 3
+#define BENCH_FRAMES 8
+
+struct bench_frame_t {
+    struct header_t header;
+    uint8_t palette[16*3];
+    uint8_t *vram;
+    uint8_t *out;
+    struct tile_cache_t *cache;
+};
+
+struct bench_kernel_t {
+    const char *name;
+    int format;                 // BG or SPR.
+    int bpp;                    // output bytes per pixel.
+    int reference;              // kernel whose output must match, or -1.
+    void (*run)(struct bench_frame_t *frame);
+};
+
+static void bench_tile_rgb(struct bench_frame_t *frame) {
+    tile_to_rgb8(frame->out, frame->vram, frame->palette, &frame->header, NULL);
+}
+
+static void bench_tile_rgb_cached(struct bench_frame_t *frame) {
+    tile_to_rgb8(frame->out, frame->vram, frame->palette, &frame->header, frame->cache);
+}
+
+static void bench_tile_index(struct bench_frame_t *frame) {
+    tile_to_index8(frame->out, frame->vram, &frame->header);
+}
+
+static void bench_sprite_rgb(struct bench_frame_t *frame) {
+    sprite_to_rgb8(frame->out, frame->vram, frame->palette, &frame->header);
+}
+
+static void bench_sprite_index(struct bench_frame_t *frame) {
+    sprite_to_index8(frame->out, frame->vram, &frame->header);
+}
+
+static const struct bench_kernel_t g_bench_kernels[] = {
+    { "tile_to_rgb8",          BG,  3, -1, bench_tile_rgb },
+    { "tile_to_rgb8 (cache)",  BG,  3,  0, bench_tile_rgb_cached },
+    { "tile_to_index8",        BG,  1,  0, bench_tile_index },
+    { "sprite_to_rgb8",        SPR, 3, -1, bench_sprite_rgb },
+    { "sprite_to_index8",      SPR, 1,  3, bench_sprite_index },
+    { NULL,                    0,   0,  0, NULL }
+};
+
+// Frame sizes used by the games, and the largest ones. Sprite frames are twice as wide as high.
+static const uint16_t g_bench_sizes[][3] = {
+    { BG, 256, 112 }, { BG, 128, 128 }, { BG, 512, 512 },
+    { SPR, 128, 64 }, { SPR, 512, 256 }
+};
+
+static inline uint64_t bench_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint32_t bench_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (uint32_t)(*state >> 32);
+}
+
+// Compare the output of a kernel with the reference output. Palette indices are converted to RGB first.
+static int bench_compare(const uint8_t *out, int bpp, const uint8_t *ref, const uint8_t *palette, size_t pixels) {
+    if(bpp == 3) {
+        return !memcmp(out, ref, pixels * 3);
+    }
+    for(size_t i=0; i<pixels; i++) {
+        if(memcmp(palette + 3*out[i], ref + 3*i, 3)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Checksums (cache keys, duplicate frames, PNG and zlib). The byte at a time versions are the references.
+static uint32_t bench_crc32_bytewise(uint32_t crc, const uint8_t *data, size_t len) {
+    while(len--) {
+        crc = g_crc32_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t bench_adler32_bytewise(uint32_t adler, const uint8_t *data, size_t len) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while(len--) {
+        a = (a + *data++) % ADLER32_BASE;
+        b = (b + a) % ADLER32_BASE;
+    }
+    return (b << 16) | a;
+}
+
+// A sector payload, a 256x112 frame and the sectors of a video.
+static const size_t g_bench_checksum_sizes[] = { 2048, 14336, 1 << 20 };
+
+struct bench_checksum_t {
+    const char *name;
+    const char *variant;
+    int reference;              // checksum whose result must match, or -1.
+    uint32_t initial;
+    checksum_func_t run;
+};
+
+static int bench_checksums(int runs, uint64_t *state) {
+    size_t size = g_bench_checksum_sizes[(sizeof(g_bench_checksum_sizes) / sizeof(g_bench_checksum_sizes[0])) - 1];
+    uint8_t *data = (uint8_t*)malloc(size);
+    int errors = 0;
+
+    if(data == NULL) {
+        fprintf(stderr, "failed to allocate benchmark buffers\n");
+        return 1;
+    }
+    for(size_t i=0; i<size; i++) {
+        data[i] = bench_random(state);
+    }
+    checksum_init();
+    // The last entry of each checksum is the function selected for this processor.
+    const struct bench_checksum_t checksum[] = {
+        { "crc32",   "bytewise",     -1, 0xffffffff, bench_crc32_bytewise },
+        { "crc32",   "slice-by-8",    0, 0xffffffff, crc32_generic },
+        { "crc32",   g_crc32_name,    0, 0xffffffff, g_crc32_func },
+        { "adler32", "bytewise",     -1, 1,          bench_adler32_bytewise },
+        { "adler32", "generic",       3, 1,          adler32_generic },
+        { "adler32", g_adler32_name,  3, 1,          g_adler32_func }
+    };
+
+    printf("\n%-22s %9s %8s %12s %12s %10s %s\n", "checksum", "bytes", "runs", "best c/B", "mean c/B", "MB/s", "check");
+    for(size_t s=0; s<(sizeof(g_bench_checksum_sizes) / sizeof(g_bench_checksum_sizes[0])); s++) {
+        size_t len = g_bench_checksum_sizes[s];
+        uint32_t expected = 0;
+        for(int n=0; n<(int)(sizeof(checksum) / sizeof(checksum[0])); n++) {
+            uint64_t best = UINT64_MAX, total = 0, best_ns = UINT64_MAX;
+            uint32_t result = 0;
+            char name[32];
+            int ok;
+            // The selected function is the generic one on processors without the extensions.
+            if((n > 0) && (checksum[n].run == checksum[n-1].run)) {
+                continue;
+            }
+            for(int r=-BENCH_WARMUP; r<runs; r++) {
+                uint64_t start = bench_clock();
+                uint64_t start_ns = stats_clock(CLOCK_MONOTONIC);
+                result = checksum[n].run(checksum[n].initial, data, len);
+                uint64_t elapsed_ns = stats_clock(CLOCK_MONOTONIC) - start_ns;
+                uint64_t elapsed = bench_clock() - start;
+                if(r >= 0) {
+                    total += elapsed;
+                    if(elapsed < best) {
+                        best = elapsed;
+                    }
+                    if(elapsed_ns < best_ns) {
+                        best_ns = elapsed_ns;
+                    }
+                }
+            }
+            if(checksum[n].reference < 0) {
+                expected = result;
+            }
+            ok = (result == expected);
+            errors += !ok;
+            snprintf(name, sizeof(name), "%s (%s)", checksum[n].name, checksum[n].variant);
+            printf("%-22s %9zu %8d %12.3f %12.3f %10.1f %s\n", name, len, runs, (double)best / len, (double)total / ((double)runs * len),
+                   best_ns ? (len * 1e9 / best_ns / 1048576.0) : 0.0, (checksum[n].reference < 0) ? "reference" : (ok ? "ok" : "MISMATCH"));
+        }
+    }
+    free(data);
+    return errors;
+}
+
+// Defined with the ADPCM decoder.
+static int bench_adpcm(int runs, uint64_t *state);
+
+int bench_kernels(int runs) {
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    int errors = 0;
+
+    if(runs < 1) {
+        runs = 1;
+    }
+    printf("%-22s %9s %8s %12s %12s %s\n", "kernel", "size", "frames", "best c/px", "mean c/px", "check");
+    for(size_t s=0; s<(sizeof(g_bench_sizes) / sizeof(g_bench_sizes[0])); s++) {
+        struct bench_frame_t frame[BENCH_FRAMES];
+        size_t pixels = g_bench_sizes[s][1] * g_bench_sizes[s][2];
+        size_t vram_size = pixels / 2;
+        uint8_t *vram = (uint8_t*)malloc(BENCH_FRAMES * vram_size);
+        uint8_t *ref = (uint8_t*)malloc(BENCH_FRAMES * pixels * 3);
+        uint8_t *out = (uint8_t*)malloc(BENCH_FRAMES * pixels * 3);
+        struct tile_cache_t *cache = (struct tile_cache_t*)calloc(1, sizeof(struct tile_cache_t));
+        uint8_t palette[16*3];
+        if((vram == NULL) || (ref == NULL) || (out == NULL) || (cache == NULL)) {
+            fprintf(stderr, "failed to allocate benchmark buffers\n");
+            free(vram); free(ref); free(out); free(cache);
+            return EXIT_FAILURE;
+        }
+
+        for(int i=0; i<(16*3); i++) {
+            palette[i] = bench_random(&state);
+        }
+        // Half of the frames are random, the other half are made of a few distinct tiles like real backgrounds.
+        for(int k=0; k<BENCH_FRAMES; k++) {
+            uint8_t *data = vram + k*vram_size;
+            for(size_t i=0; i<vram_size; i++) {
+                data[i] = bench_random(&state);
+            }
+            if(k & 1) {
+                for(size_t i=32*16; i<vram_size; i+=32) {
+                    memcpy(data + i, data + (bench_random(&state) % 16) * 32, 32);
+                }
+            }
+            memset(&frame[k], 0, sizeof(frame[k]));
+            frame[k].header.width = g_bench_sizes[s][1];
+            frame[k].header.height = g_bench_sizes[s][2];
+            frame[k].header.format = g_bench_sizes[s][0];
+            memcpy(frame[k].palette, palette, 16*3);
+            frame[k].vram = data;
+            frame[k].cache = cache;
+        }
+
+        for(int n=0; g_bench_kernels[n].name; n++) {
+            const struct bench_kernel_t *kernel = &g_bench_kernels[n];
+            uint64_t best = UINT64_MAX, total = 0;
+            int ok = 1;
+            if(kernel->format != g_bench_sizes[s][0]) {
+                continue;
+            }
+            memset(cache->valid, 0, sizeof(cache->valid));
+            for(int r=-BENCH_WARMUP; r<runs; r++) {
+                uint64_t start, elapsed;
+                for(int k=0; k<BENCH_FRAMES; k++) {
+                    frame[k].out = ((kernel->reference < 0) ? ref : out) + k*pixels*3;
+                }
+                start = bench_clock();
+                for(int k=0; k<BENCH_FRAMES; k++) {
+                    kernel->run(&frame[k]);
+                }
+                elapsed = bench_clock() - start;
+                if(r >= 0) {
+                    total += elapsed;
+                    if(elapsed < best) {
+                        best = elapsed;
+                    }
+                }
+                for(int k=0; ok && (kernel->reference >= 0) && (k<BENCH_FRAMES); k++) {
+                    ok = bench_compare(out + k*pixels*3, kernel->bpp, ref + k*pixels*3, palette, pixels);
+                }
+            }
+            if(!ok) {
+                errors++;
+            }
+            printf("%-22s %4dx%-4d %8d %12.3f %12.3f %s\n", kernel->name, g_bench_sizes[s][1], g_bench_sizes[s][2], BENCH_FRAMES,
+                   (double)best / (BENCH_FRAMES * pixels), (double)total / ((double)runs * BENCH_FRAMES * pixels),
+                   (kernel->reference < 0) ? "reference" : (ok ? "ok" : "MISMATCH"));
+        }
+        free(vram);
+        free(ref);
+        free(out);
+        free(cache);
+    }
+    errors += bench_checksums(runs, &state);
+    errors += bench_adpcm(runs, &state);
+#if !defined(__x86_64__) && !defined(__i386__)
+    printf("(times are in nanoseconds per pixel, per byte or per sample)\n");
+#endif
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Output files.
+ * Files are created in the output directory, or appended to a tar archive when --tar is used.
+ * The archive is written sequentially. Files are buffered in memory until they are closed
+ * as each tar entry starts with the file size.
+ */
+#define TAR_BLOCK_SIZE 512
+#define OUTPUT_BUFFER_SIZE (128*1024)
+
+enum FsyncPolicy {
+    FSYNC_NONE = 0,         // let the system write the files back.
+    FSYNC_FILE,             // every file (and directory) is synced when closed.
+    FSYNC_END               // the output file system is synced once at exit.
+};
+
+static int g_fsync = FSYNC_NONE;
+static int g_preallocate = 0;
+
+struct output_file_t {
+    FILE *out;
+    char *name;
+    char *buffer;           // file content (tar archive) or stdio buffer.
+    size_t size;
+};
+
+static FILE *g_tar = NULL;
+static uint32_t g_tar_mtime;
+
+static int tar_write_header(const char *name, size_t size, char type, const char *link) {
+    uint8_t header[TAR_BLOCK_SIZE];
+    uint32_t checksum = 0;
+
+    if((strlen(name) >= 100) || (link && (strlen(link) >= 100))) {
+        fprintf(stderr, "tar entry name too long: %s\n", name);
+        return 0;
+    }
+    // ustar header.
+    memset(header, 0, TAR_BLOCK_SIZE);
+    strcpy((char*)header, name);
+    snprintf((char*)header+100, 8, "%07o", (type == '5') ? 0755 : 0644);
+    snprintf((char*)header+108, 8, "%07o", 0);
+    snprintf((char*)header+116, 8, "%07o", 0);
+    snprintf((char*)header+124, 12, "%011llo", (unsigned long long)size);
+    snprintf((char*)header+136, 12, "%011o", g_tar_mtime);
+    memset(header+148, ' ', 8);
+    header[156] = type;
+    if(link) {
+        strcpy((char*)header+157, link);
+    }
+    memcpy(header+257, "ustar", 6);
+    memcpy(header+263, "00", 2);
+    for(int i=0; i<TAR_BLOCK_SIZE; i++) {
+        checksum += header[i];
+    }
+    snprintf((char*)header+148, 8, "%06o", checksum);
+    return fwrite(header, 1, TAR_BLOCK_SIZE, g_tar) == TAR_BLOCK_SIZE;
+}
+
+static int tar_write_entry(const char *name, const void *data, size_t size) {
+    static const uint8_t padding[TAR_BLOCK_SIZE] = {0};
+    size_t pad = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+    return tar_write_header(name, size, '0', NULL)
+        && (!size || (fwrite(data, 1, size, g_tar) == size))
+        && (fwrite(padding, 1, pad, g_tar) == pad);
+}
+
+int output_tar_open(const char *filename) {
+    if(strcmp(filename, "-") == 0) {
+        g_tar = stdout;
+    }
+    else {
+        g_tar = fopen(filename, "wb");
+        if(g_tar == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+            return 0;
+        }
+    }
+    g_tar_mtime = (uint32_t)time(NULL);
+    return 1;
+}
+
+// Write the end of archive marker (2 empty blocks).
+int output_tar_close() {
+    static const uint8_t end[2*TAR_BLOCK_SIZE] = {0};
+    int ret;
+    if(g_tar == NULL) {
+        return 1;
+    }
+    ret = (fwrite(end, 1, sizeof(end), g_tar) == sizeof(end));
+    ret = (fflush(g_tar) == 0) && ret;
+    if(g_tar != stdout) {
+        if(g_fsync != FSYNC_NONE) {
+            ret = (fsync(fileno(g_tar)) == 0) && ret;
+        }
+        ret = (fclose(g_tar) == 0) && ret;
+    }
+    g_tar = NULL;
+    return ret;
+}
+
+// File names given to the output functions are relative to the output directory. Files created in the last
+// video directory (output_mkdir) are opened relative to it, so that paths are not resolved again for each frame.
+static int g_output_dir = -1;
+static int g_video_dir = -1;
+static char g_video_dir_name[32];
+
+int output_dir_open(const char *prefix) {
+    g_output_dir = open(prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(g_output_dir < 0) {
+        fprintf(stderr, "failed to open %s: %s\n", prefix, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+static int output_video_dir_close() {
+    int ret = 1;
+    if(g_video_dir >= 0) {
+        // Make the directory entries durable.
+        if(g_fsync == FSYNC_FILE) {
+            ret = (fsync(g_video_dir) == 0);
+        }
+        close(g_video_dir);
+        g_video_dir = -1;
+    }
+    return ret;
+}
+
+int output_dir_close() {
+    int ret;
+    int stage;
+    if(g_output_dir < 0) {
+        return 1;
+    }
+    stage = stats_stage(STAGE_WRITE);
+    ret = output_video_dir_close();
+    if(g_fsync == FSYNC_FILE) {
+        ret = (fsync(g_output_dir) == 0) && ret;
+    }
+    else if(g_fsync == FSYNC_END) {
+        // Only the file system holding the output directory.
+        ret = (syncfs(g_output_dir) == 0) && ret;
+    }
+    close(g_output_dir);
+    g_output_dir = -1;
+    stats_stage(stage);
+    return ret;
+}
+
+// Return the directory descriptor a file name is relative to, and the file name in this directory.
+static int output_resolve(const char *name, const char **base) {
+    const char *slash = strrchr(name, '/');
+    size_t len = slash ? (size_t)(slash - name) : 0;
+    if(slash && (g_video_dir >= 0) && (len == strlen(g_video_dir_name)) && !strncmp(name, g_video_dir_name, len)) {
+        *base = slash+1;
+        return g_video_dir;
+    }
+    *base = name;
+    return g_output_dir;
+}
+
+// Create a file and return its descriptor.
+static int output_create(const char *name) {
+    const char *base;
+    int dir = output_resolve(name, &base);
+    return openat(dir, base, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+// Reserve the disk space of a file whose size is known in advance (--preallocate).
+static int output_preallocate(int fd, size_t size) {
+    int err;
+    if(!g_preallocate || (size == 0)) {
+        return 1;
+    }
+    err = posix_fallocate(fd, 0, size);
+    // Not every file system supports it.
+    return (err == 0) || (err == EOPNOTSUPP) || (err == EINVAL);
+}
+
+static int output_write_fd(int fd, const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t*)data;
+    while(size) {
+        ssize_t n = write(fd, ptr, size);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        ptr += n;
+        size -= n;
+    }
+    return 1;
+}
+
+int output_mkdir(const char *prefix, const char *name) {
+    int stage = stats_stage(STAGE_WRITE);
+    int ret = 1;
+    if(g_tar) {
+        size_t len = strlen(name);
+        char *entry = (char*)malloc(len + 2);
+        memcpy(entry, name, len);
+        strcpy(entry + len, "/");
+        ret = tar_write_header(entry, 0, '5', NULL);
+        free(entry);
+    }
+    else if(!output_video_dir_close()) {
+        fprintf(stderr, "failed to sync %s/%s: %s\n", prefix, g_video_dir_name, strerror(errno));
+        ret = 0;
+    }
+    else if((mkdirat(g_output_dir, name, 0755) < 0) && (errno != EEXIST)) {
+        fprintf(stderr, "failed to create %s/%s: %s\n", prefix, name, strerror(errno));
+        ret = 0;
+    }
+    else {
+        g_video_dir = openat(g_output_dir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(g_video_dir < 0) {
+            fprintf(stderr, "failed to open %s/%s: %s\n", prefix, name, strerror(errno));
+            ret = 0;
+        }
+        else {
+            snprintf(g_video_dir_name, sizeof(g_video_dir_name), "%s", name);
+        }
+    }
+    stats_stage(stage);
+    return ret;
+}
+
+struct output_file_t* output_open(const char *prefix, const char *name) {
+    struct output_file_t *file = (struct output_file_t*)calloc(1, sizeof(struct output_file_t));
+    int stage;
+    if(file == NULL) {
+        return NULL;
+    }
+    stage = stats_stage(STAGE_WRITE);
+    file->name = strdup(name);
+    if(g_tar) {
+        file->out = open_memstream(&file->buffer, &file->size);
+    }
+    else {
+        // Data is written by chunks of OUTPUT_BUFFER_SIZE bytes (a single write for most frames).
+        int fd = output_create(name);
+        file->buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+        if((fd >= 0) && file->buffer) {
+            file->out = fdopen(fd, "wb");
+        }
+        if(file->out) {
+            setvbuf(file->out, file->buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+        }
+        else if(fd >= 0) {
+            close(fd);
+        }
+    }
+    if(file->out == NULL) {
+        fprintf(stderr, "failed to open %s/%s: %s\n", prefix, name, strerror(errno));
+        free(file->buffer);
+        free(file->name);
+        free(file);
+        file = NULL;
+    }
+    stats_stage(stage);
+    return file;
+}
+
+// Reserve space for a file whose final size is known.
+int output_reserve(struct output_file_t *file, size_t size) {
+    return g_tar || output_preallocate(fileno(file->out), size);
+}
+
+int output_close(struct output_file_t *file) {
+    int stage = stats_stage(STAGE_WRITE);
+    int ret = 1;
+    long size = ftell(file->out);
+    if(!g_tar && (g_fsync == FSYNC_FILE)) {
+        ret = (fflush(file->out) == 0) && (fsync(fileno(file->out)) == 0);
+    }
+    ret = (fclose(file->out) == 0) && ret;
+    if(g_tar && ret) {
+        ret = tar_write_entry(file->name, file->buffer, file->size);
+    }
+    if(!ret) {
+        fprintf(stderr, "failed to write %s: %s\n", file->name, strerror(errno));
+    }
+    else {
+        g_stats.files++;
+        g_stats.bytes_written += (size > 0) ? size : 0;
+    }
+    free(file->buffer);
+    free(file->name);
+    free(file);
+    stats_stage(stage);
+    return ret;
+}
+
+// Write a whole file at once.
+int output_write_file(const char *prefix, const char *name, const void *data, size_t size) {
+    int stage = stats_stage(STAGE_WRITE);
+    int fd;
+    int ret;
+    if(g_tar) {
+        ret = tar_write_entry(name, data, size);
+    }
+    else if((fd = output_create(name)) < 0) {
+        fprintf(stderr, "failed to open %s/%s: %s\n", prefix, name, strerror(errno));
+        ret = 0;
+    }
+    else {
+        ret = output_preallocate(fd, size)
+           && output_write_fd(fd, data, size)
+           && ((g_fsync != FSYNC_FILE) || (fsync(fd) == 0));
+        ret = (close(fd) == 0) && ret;
+        if(!ret) {
+            fprintf(stderr, "failed to write %s/%s: %s\n", prefix, name, strerror(errno));
+        }
+    }
+    if(ret) {
+        g_stats.files++;
+        g_stats.bytes_written += size;
+    }
+    stats_stage(stage);
+    return ret;
+}
+
+// Create a hard link to a file written earlier. An existing file is replaced.
+int output_link(const char *prefix, const char *target, const char *name) {
+    const char *target_base;
+    const char *base;
+    int target_dir, dir;
+    int stage = stats_stage(STAGE_WRITE);
+    int ret;
+    if(g_tar) {
+        ret = tar_write_header(name, 0, '1', target);
+    }
+    else {
+        target_dir = output_resolve(target, &target_base);
+        dir = output_resolve(name, &base);
+        // The file system may not support hard links, the caller will write the file instead.
+        ret = ((unlinkat(dir, base, 0) == 0) || (errno == ENOENT))
+           && (linkat(target_dir, target_base, dir, base, 0) == 0);
+    }
+    (void)prefix;
+    g_stats.links += ret;
+    stats_stage(stage);
+    return ret;
+}
+
+static void put_le16(uint8_t *out, uint32_t v) {
+    out[0] = v;
+    out[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *out, uint32_t v) {
+    out[0] = v;
+    out[1] = v >> 8;
+    out[2] = v >> 16;
+    out[3] = v >> 24;
+}
+
+// Dialogic (OKI) ADPCM decoder.
+// Each byte holds 2 samples (high nibble first). Samples are 12 bits and are scaled to 16 bits.
+enum AudioFormat {
+    AUDIO_VOX = 0,          // raw adpcm data.
+    AUDIO_WAV,              // 16 bits PCM WAV.
+    AUDIO_PCM               // 16 bits little endian PCM without header.
+};
+
+static int g_audio_format = AUDIO_VOX;
+static int g_audio_rate = 16000;
+
+static const char *g_audio_extension[] = { "vox", "wav", "pcm" };
+
+struct oki_t {
+    int16_t sample;
+    uint8_t step;
+};
+
+static const int16_t g_oki_steps[49] = {
+      16,   17,   19,   21,   23,   25,   28,   31,   34,   37,   41,   45,   50,   55,   60,   66,
+      73,   80,   88,   97,  107,  118,  130,  143,  157,  173,  190,  209,  230,  253,  279,  307,
+     337,  371,  408,  449,  494,  544,  598,  658,  724,  796,  876,  963, 1060, 1166, 1282, 1411,
+    1552
+};
+static const int8_t g_oki_adjust[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+static int16_t g_oki_delta[49][16];
+static uint8_t g_oki_next[49][16];
+
+static void oki_init_tables() {
+    static int initialized = 0;
+    if(initialized) {
+        return;
+    }
+    for(int i=0; i<49; i++) {
+        int step = g_oki_steps[i];
+        for(int code=0; code<16; code++) {
+            int delta = step >> 3;
+            int next = i + g_oki_adjust[code & 7];
+            if(code & 4) {
+                delta += step;
+            }
+            if(code & 2) {
+                delta += step >> 1;
+            }
+            if(code & 1) {
+                delta += step >> 2;
+            }
+            g_oki_delta[i][code] = (code & 8) ? -delta : delta;
+            g_oki_next[i][code] = (next < 0) ? 0 : ((next > 48) ? 48 : next);
+        }
+    }
+    initialized = 1;
+}
+
+static inline int16_t oki_decode_nibble(struct oki_t *oki, int code) {
+    int sample = oki->sample + g_oki_delta[oki->step][code];
+    if(sample > 2047) {
+        sample = 2047;
+    }
+    else if(sample < -2048) {
+        sample = -2048;
+    }
+    oki->sample = sample;
+    oki->step = g_oki_next[oki->step][code];
+    return sample;
+}
+
+// Decode len bytes of adpcm data as 16 bits little endian samples (4*len bytes).
+static void oki_decode(struct oki_t *oki, const uint8_t *in, size_t len, uint8_t *out) {
+    for(size_t i=0; i<len; i++) {
+        int16_t s0 = oki_decode_nibble(oki, in[i] >> 4) * 16;
+        int16_t s1 = oki_decode_nibble(oki, in[i] & 0x0f) * 16;
+        *out++ = s0;
+        *out++ = (uint16_t)s0 >> 8;
+        *out++ = s1;
+        *out++ = (uint16_t)s1 >> 8;
+    }
+}
+
+// ADPCM decoder benchmark (--bench-kernels). The reference decoder computes every step from the step table
+// instead of using the precomputed delta and next step tables.
+static void bench_oki_reference(struct oki_t *oki, const uint8_t *in, size_t len, uint8_t *out) {
+    for(size_t i=0; i<(2*len); i++, out+=2) {
+        int code = (i & 1) ? (in[i/2] & 0x0f) : (in[i/2] >> 4);
+        int step = g_oki_steps[oki->step];
+        int delta = (step >> 3) + ((code & 4) ? step : 0) + ((code & 2) ? (step >> 1) : 0) + ((code & 1) ? (step >> 2) : 0);
+        int sample = oki->sample + ((code & 8) ? -delta : delta);
+        int next = oki->step + g_oki_adjust[code & 7];
+        sample = (sample > 2047) ? 2047 : ((sample < -2048) ? -2048 : sample);
+        oki->sample = sample;
+        oki->step = (next < 0) ? 0 : ((next > 48) ? 48 : next);
+        put_le16(out, (uint16_t)(sample * 16));
+    }
+}
+
+// A sector of adpcm data, and a long audio track.
+static const size_t g_bench_adpcm_sizes[] = { 2048, 1 << 20 };
+
+static int bench_adpcm(int runs, uint64_t *state) {
+    size_t size = g_bench_adpcm_sizes[(sizeof(g_bench_adpcm_sizes) / sizeof(g_bench_adpcm_sizes[0])) - 1];
+    uint8_t *data = (uint8_t*)malloc(size);
+    uint8_t *ref = (uint8_t*)malloc(4 * size);
+    uint8_t *out = (uint8_t*)malloc(4 * size);
+    int errors = 0;
+
+    if((data == NULL) || (ref == NULL) || (out == NULL)) {
+        fprintf(stderr, "failed to allocate benchmark buffers\n");
+        free(data); free(ref); free(out);
+        return 1;
+    }
+    for(size_t i=0; i<size; i++) {
+        data[i] = bench_random(state);
+    }
+    oki_init_tables();
+    const struct {
+        const char *name;
+        void (*run)(struct oki_t *oki, const uint8_t *in, size_t len, uint8_t *out);
+    } decoder[] = {
+        { "oki (reference)", bench_oki_reference },
+        { "oki_decode",      oki_decode }
+    };
+
+    printf("\n%-22s %9s %8s %12s %12s %10s %s\n", "adpcm", "bytes", "runs", "best c/smp", "mean c/smp", "Msmp/s", "check");
+    for(size_t s=0; s<(sizeof(g_bench_adpcm_sizes) / sizeof(g_bench_adpcm_sizes[0])); s++) {
+        size_t len = g_bench_adpcm_sizes[s];
+        size_t samples = 2 * len;
+        for(int n=0; n<(int)(sizeof(decoder) / sizeof(decoder[0])); n++) {
+            uint64_t best = UINT64_MAX, total = 0, best_ns = UINT64_MAX;
+            int ok = 1;
+            for(int r=-BENCH_WARMUP; r<runs; r++) {
+                struct oki_t oki = { 0, 0 };
+                uint64_t start = bench_clock();
+                uint64_t start_ns = stats_clock(CLOCK_MONOTONIC);
+                decoder[n].run(&oki, data, len, n ? out : ref);
+                uint64_t elapsed_ns = stats_clock(CLOCK_MONOTONIC) - start_ns;
+                uint64_t elapsed = bench_clock() - start;
+                if(r >= 0) {
+                    total += elapsed;
+                    if(elapsed < best) {
+                        best = elapsed;
+                    }
+                    if(elapsed_ns < best_ns) {
+                        best_ns = elapsed_ns;
+                    }
+                }
+                if(n && ok) {
+                    ok = !memcmp(out, ref, 2 * samples);
+                }
+            }
+            errors += !ok;
+            printf("%-22s %9zu %8d %12.3f %12.3f %10.1f %s\n", decoder[n].name, len, runs, (double)best / samples,
+                   (double)total / ((double)runs * samples), best_ns ? (samples * 1e3 / best_ns) : 0.0,
+                   n ? (ok ? "ok" : "MISMATCH") : "reference");
+        }
+    }
+    free(data);
+    free(ref);
+    free(out);
+    return errors;
+}
+
+// Build the 44 bytes header of a mono 16 bits PCM WAV file.
+static void wav_put_header(uint8_t *header, uint32_t sample_count, uint32_t rate) {
+    uint32_t data_len = sample_count * 2;
+    memcpy(header, "RIFF", 4);
+    put_le32(header+4, 36 + data_len);
+    memcpy(header+8, "WAVEfmt ", 8);
+    put_le32(header+16, 16);        // fmt chunk size
+    put_le16(header+20, 1);         // PCM
+    put_le16(header+22, 1);         // mono
+    put_le32(header+24, rate);
+    put_le32(header+28, rate * 2);  // bytes per second
+    put_le16(header+32, 2);         // block align
+    put_le16(header+34, 16);        // bits per sample
+    memcpy(header+36, "data", 4);
+    put_le32(header+40, data_len);
+}
+
+// Image window.
+// The image is read once, in order. The bytes read are kept in a window starting at the current scan offset:
+// the headers are probed from it, and the demultiplexer of a video points to its sectors in it. The window
+// only moves forward, the bytes it already holds are kept when it moves and the following ones are read
+// ahead. It grows to the extent of the largest video.
+#define WINDOW_SECTORS 64
+
+struct window_t {
+    uint8_t *data;
+    int64_t offset;         // image offset of the first byte.
+    size_t len;             // number of bytes held.
+    size_t capacity;
+    int64_t position;       // image file position, or -1 if unknown.
+};
+
+// Get the size bytes of the image at offset (offset must not be lower than the one of the previous call).
+// Only the bytes up to image_size are read, their number is returned in len. Returns NULL if the window could
+// not be enlarged, it is then left untouched.
+static const uint8_t* window_get(struct window_t *window, FILE *in, int64_t offset, size_t size, size_t image_size, size_t *len) {
+    size_t available = ((size_t)offset < image_size) ? (image_size - offset) : 0;
+    size_t shift;
+    if(size > available) {
+        size = available;
+    }
+    if((offset < window->offset) || (offset > (window->offset + (int64_t)window->len))) {
+        window->offset = offset;
+        window->len = 0;
+    }
+    shift = offset - window->offset;
+    if((shift + size) > window->capacity) {
+        // Move the bytes still needed to the beginning of the window, and enlarge it if needed.
+        if((window->data == NULL) || (size > window->capacity)) {
+            size_t capacity = (size > (WINDOW_SECTORS * g_sector_size)) ? size : (WINDOW_SECTORS * g_sector_size);
+            uint8_t *data = (uint8_t*)realloc(window->data, capacity);
+            if(data == NULL) {
+                fprintf(stderr, "failed to allocate %zu bytes: %s\n", capacity, strerror(errno));
+                return NULL;
+            }
+            window->data = data;
+            window->capacity = capacity;
+        }
+        memmove(window->data, window->data + shift, window->len - shift);
+        window->offset = offset;
+        window->len -= shift;
+        shift = 0;
+    }
+    if((shift + size) > window->len) {
+        int64_t end = window->offset + window->len;
+        size_t count = window->capacity - window->len;
+        if(count > (image_size - end)) {
+            count = image_size - end;
+        }
+        if((window->position != end) && (image_seek(in, end) < 0)) {
+            window->position = -1;
+        }
+        else {
+            size_t n_read = image_read(window->data + window->len, count, in);
+            window->len += n_read;
+            window->position = end + n_read;
+        }
+    }
+    *len = ((shift + size) > window->len) ? (window->len - shift) : size;
+    return window->data + shift;
+}
+
+static void window_close(struct window_t *window) {
+    free(window->data);
+    memset(window, 0, sizeof(struct window_t));
+    window->position = -1;
+}
+
+// Video demultiplexer.
+// All the sectors of a video (header, palette, adpcm data and frames) are gathered in the image window, in
+// order. The audio and frame data are then gathered from the payload of the sectors (their first 2048 bytes).
+struct demux_t {
+    const uint8_t *data;    // raw sectors, starting at the video header.
+    size_t len;             // number of bytes available (the image may end before the last sector).
+    size_t sectors;         // number of sectors spanned by the video.
+};
+
+// Get the sectors of a video from the image window. The header may announce more sectors than the image holds,
+// only the bytes up to image_size are read. The sectors remain valid until the next access to the window.
+static int demux_open(struct demux_t *demux, struct window_t *window, FILE *in, int64_t offset, size_t sectors, size_t image_size) {
+    demux->sectors = sectors;
+    int stage = stats_stage(STAGE_READ);
+    demux->data = window_get(window, in, offset, sectors * g_sector_size, image_size, &demux->len);
+    stats_stage(stage);
+    if(demux->data == NULL) {
+        demux->len = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static void demux_close(struct demux_t *demux) {
+    demux->data = NULL;
+    demux->len = demux->sectors = 0;
+}
+
+// Copy len bytes of the payload of a sector from start. Returns 0 if the bytes past the end of the image were
+// missing, they are set to 0.
+static int demux_copy(const struct demux_t *demux, size_t sector, size_t start, uint8_t *out, size_t len) {
+    size_t pos = sector * g_sector_size + start;
+    size_t available = (pos < demux->len) ? (demux->len - pos) : 0;
+    if(available >= len) {
+        memcpy(out, demux->data + pos, len);
+        return 1;
+    }
+    if(available) {
+        memcpy(out, demux->data + pos, available);
+    }
+    memset(out + available, 0, len - available);
+    return 0;
+}
+
+// Compare data with len bytes gathered from the 2048 bytes payloads of consecutive sectors starting at sector.
+// Bytes past the end of the image read as 0 (see demux_copy).
+static int demux_compare(const struct demux_t *demux, size_t sector, const uint8_t *data, size_t len) {
+    for(; len > 0; sector++) {
+        size_t count = (len >= 2048) ? 2048 : len;
+        size_t pos = sector * g_sector_size;
+        size_t available = (pos < demux->len) ? (demux->len - pos) : 0;
+        if(available > count) {
+            available = count;
+        }
+        if(available && memcmp(demux->data + pos, data, available)) {
+            return 0;
+        }
+        for(size_t i=available; i<count; i++) {
+            if(data[i]) {
+                return 0;
+            }
+        }
+        data += count;
+        len -= count;
+    }
+    return 1;
+}
+
+// Number of sectors holding the adpcm data of a video (see adpcm_read).
+static size_t adpcm_extent(struct header_t *header) {
+    if(header->adpcm_len == 0) {
+        return 0;
+    }
+    if(header->adpcm_len < 2048) {
+        return 2;
+    }
+    return (header->adpcm_len + 0x40 + 2047) / 2048;
+}
+
+// Gather the adpcm data of a video (header->adpcm_len bytes) in out.
+// The data starts 0x40 bytes after the video header. The last sector only provides the bytes that are still
+// missing, counted from its beginning.
+static int adpcm_read(const struct demux_t *demux, struct header_t *header, uint8_t *out) {
+    size_t remaining;
+    size_t start;
+    size_t sector;
+    int ret = 1;
+
+    start = 0x40;
+    for(sector=0, remaining=header->adpcm_len; (remaining > 0) && ret; sector++) {
+        size_t count = (remaining >= 2048) ? 2048 : remaining;
+        ret = (count >= start) && demux_copy(demux, sector, start, out, count - start);
+        out += count - start;
+        remaining -= count - start;
+        start = 0;
+    }
+    if(!ret) {
+        fprintf(stderr, "failed to read %u bytes of adpcm data\n", header->adpcm_len);
+    }
+    return ret;
+}
+
+// Read the adpcm data of a video and decode it to 16 bits PCM samples if decode is set.
+// head bytes are left free in front of the data for a file header.
+// Returns the buffer (head + header->adpcm_len bytes, or 4 times as many samples bytes once decoded) or NULL on error.
+static uint8_t* adpcm_load(const struct demux_t *demux, struct header_t *header, int decode, size_t head, size_t *len) {
+    struct oki_t oki = { 0, 0 };
+    uint8_t *adpcm;
+    uint8_t *data;
+
+    *len = (size_t)header->adpcm_len * (decode ? 4 : 1);
+    data = (uint8_t*)malloc(head + *len + 1);
+    if(data == NULL) {
+        return NULL;
+    }
+    if(!decode) {
+        if(!adpcm_read(demux, header, data + head)) {
+            free(data);
+            return NULL;
+        }
+        return data;
+    }
+
+    // Every adpcm byte is decoded as 2 16 bits samples.
+    adpcm = (uint8_t*)malloc(header->adpcm_len + 1);
+    if((adpcm == NULL) || !adpcm_read(demux, header, adpcm)) {
+        free(adpcm);
+        free(data);
+        return NULL;
+    }
+    oki_init_tables();
+    oki_decode(&oki, adpcm, header->adpcm_len, data + head);
+    free(adpcm);
+    return data;
+}
+
+int extract_adpcm(const struct demux_t *demux, struct header_t *header, const char *prefix, const char *filename) {
+    uint8_t *data;
+    size_t head;
+    size_t len;
+    int ret;
+
+    // The whole file is built in memory and written at once.
+    head = (g_audio_format == AUDIO_WAV) ? 44 : 0;
+    data = adpcm_load(demux, header, g_audio_format != AUDIO_VOX, head, &len);
+    if(data == NULL) {
+        return EXIT_FAILURE;
+    }
+    if(head) {
+        wav_put_header(data, len / 2, g_audio_rate);
+    }
+    ret = output_write_file(prefix, filename, data, head + len);
+    free(data);
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Output formats.
+ * Each video is written by an output format. begin() is called once the palette is known, frame() for each
+ * decoded frame and end() once all frames were processed.
+ */
+enum OutputFlag {
+    OUTPUT_RGB     = 1,     // frame() needs video->rgb.
+    OUTPUT_INDEXED = 2,     // frame() needs video->indexed.
+    OUTPUT_DELTA   = 4,     // frame() only needs to write the video->dirty area.
+    OUTPUT_PIPE    = 8,     // frames are written to the standard output, no file is created.
+    OUTPUT_FILES   = 16,    // each frame is written to its own file.
+    OUTPUT_AUDIO   = 32     // the decoded adpcm samples (video->audio) are stored with the frames.
+};
+
+struct rect_t {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+};
+
+struct video_t {
+    int32_t index;
+    struct header_t *header;
+    const char *prefix;
+    uint8_t palette[16*3];
+    uint8_t *vram;          // current frame planar vram data.
+    uint8_t *rgb;           // current frame as RGB8.
+    uint8_t *indexed;       // current frame as palette indices.
+    uint8_t *previous;      // previous frame planar vram data (OUTPUT_DELTA).
+    struct tile_cache_t *tiles; // converted BG tiles.
+    struct rect_t dirty;    // area that changed since the previous frame (OUTPUT_DELTA).
+    uint32_t *hash;         // checksums of the distinct frames read so far (2 per frame).
+    int32_t *first;         // index of the first occurrence of each distinct frame.
+    int distinct;           // number of distinct frames.
+    uint8_t *audio;         // 16 bits PCM samples (OUTPUT_AUDIO).
+    size_t audio_len;       // size of the audio data in bytes.
+    char *filename;
+    size_t filename_len;
+    void *state;            // output format private data.
+};
+
+struct output_format_t {
+    const char *name;
+    int flags;
+    int (*begin)(struct video_t *video);
+    int (*frame)(struct video_t *video, int k);
+    int (*end)(struct video_t *video);
+    // Optional. Write frame k, identical to the frame original, without converting it.
+    // Returns 0 if the frame has to be written normally.
+    int (*duplicate)(struct video_t *video, int k, int original);
+};
+
+// Compute the bounding rectangle of the 8x8 tiles (BG) or 16x16 sprite cells (SPR) that changed since the previous frame.
+// The raw vram data is compared as the palette is the same for all frames.
+static void frame_delta(struct video_t *video, int k, struct rect_t *rect) {
+    struct header_t *header = video->header;
+    int x0 = header->width, y0 = header->height, x1 = 0, y1 = 0;
+    int cell_size, cell_count, row_count;
+
+    if(header->format == BG) {
+        cell_size = 8;
+        row_count = header->width / 8;
+        cell_count = row_count * (header->height / 8);
+    }
+    else {
+        cell_size = 16;
+        row_count = header->width / 16;
+        cell_count = row_count * (header->height / 16);
+    }
+
+    rect->x = rect->y = 0;
+    rect->width = header->width;
+    rect->height = header->height;
+    if(k == 0) {
+        return;
+    }
+
+    size_t bytes = cell_size * cell_size / 2;
+    for(int n=0; n<cell_count; n++) {
+        if(!memcmp(video->vram + n*bytes, video->previous + n*bytes, bytes)) {
+            continue;
+        }
+        int i = n % row_count;
+        int j = n / row_count;
+        int x, y;
+        if(header->format == BG) {
+            x = i * 8;
+            y = j * 8;
+        }
+        else {
+            // See sprite_to_rgb8.
+            x = ((i & 1) * 16) + (j * 32);
+            y = (i >> 1) * 16;
+        }
+        if(x < x0) x0 = x;
+        if(y < y0) y0 = y;
+        if((x + cell_size) > x1) x1 = x + cell_size;
+        if((y + cell_size) > y1) y1 = y + cell_size;
+    }
+
+    if(x1 == 0) {
+        // Nothing changed, a single cell is written.
+        x0 = y0 = 0;
+        x1 = y1 = cell_size;
+    }
+    rect->x = x0;
+    rect->y = y0;
+    rect->width = x1 - x0;
+    rect->height = y1 - y0;
+}
+
+// Look for an earlier frame of the video with the same vram data. Returns the index of its first occurrence,
+// or -1 if the frame was not seen yet. Frames are compared using their CRC-32 and Adler-32, and the matching
+// frame is compared byte by byte with its sectors (frame j starts at sector + j*frame_sectors).
+static int frame_duplicate(struct video_t *video, const struct demux_t *demux, size_t sector, size_t frame_sectors, int k, size_t len) {
+    uint32_t crc = crc32_update(0, video->vram, len);
+    uint32_t adler = adler32(1, video->vram, len);
+    for(int i=0; i<video->distinct; i++) {
+        if((video->hash[2*i] == crc) && (video->hash[2*i+1] == adler)
+        && demux_compare(demux, sector + (size_t)video->first[i] * frame_sectors, video->vram, len)) {
+            return video->first[i];
+        }
+    }
+    video->hash[2*video->distinct] = crc;
+    video->hash[2*video->distinct+1] = adler;
+    video->first[video->distinct++] = k;
+    return -1;
+}
+
+// Link the file of a duplicate frame to the file of the original frame.
+static int video_link_frame(struct video_t *video, int k, int original, const char *extension) {
+    char target[32];
+    snprintf(target, sizeof(target), "%04d/%06d.%s", video->index, original, extension);
+    snprintf(video->filename, video->filename_len, "%04d/%06d.%s", video->index, k, extension);
+    return output_link(video->prefix, target, video->filename);
+}
+
+// Create the directory holding the frames of a video: <prefix>/<index>
+static int video_mkdir(struct video_t *video) {
+    snprintf(video->filename, video->filename_len, "%04d", video->index);
+    return output_mkdir(video->prefix, video->filename);
+}
+
+// One PNG file per frame: <prefix>/<index>/<frame>.png
+static void png_put32(uint8_t *out, uint32_t v) {
+    out[0] = v >> 24;
+    out[1] = v >> 16;
+    out[2] = v >> 8;
+    out[3] = v;
+}
+
+// Write a PNG chunk. The chunk data is the concatenation of head and data (head may be NULL).
+static int png_write_chunk(FILE *out, const char *tag, const uint8_t *head, size_t head_len, const uint8_t *data, size_t len) {
+    uint8_t buffer[8];
+    uint32_t crc;
+
+    png_put32(buffer, (uint32_t)(head_len + len));
+    memcpy(buffer+4, tag, 4);
+    crc = crc32_update(0, buffer+4, 4);
+    crc = crc32_update(crc, head, head_len);
+    crc = crc32_update(crc, data, len);
+    if(fwrite(buffer, 1, 8, out) != 8) {
+        return 0;
+    }
+    if(head_len && (fwrite(head, 1, head_len, out) != head_len)) {
+        return 0;
+    }
+    if(len && (fwrite(data, 1, len, out) != len)) {
+        return 0;
+    }
+    png_put32(buffer, crc);
+    return fwrite(buffer, 1, 4, out) == 4;
+}
+
+// Pack a line of palette indices as 4 bits per pixel.
+static uint8_t* png_pack_index4(uint8_t *out, const uint8_t *in, int width) {
+    for(int x=0; x<width; x+=2) {
+        *out++ = (in[x] << 4) | (((x+1) < width) ? in[x+1] : 0);
+    }
+    return out;
+}
+
+#define PNG_COLOR_RGB 2
+#define PNG_COLOR_INDEXED 3
+
+#define PNG_IDAT_SIZE 65536
+
+// Streaming PNG encoder. Lines are filtered, compressed and written as IDAT chunks as they come, so that only
+// the previous line and the compressor window are kept in memory.
+struct png_writer_t {
+    FILE *out;
+    struct deflate_t *z;
+    int color_type;
+    int width;
+    int bpp;                // bytes per pixel used by the filters.
+    size_t line_len;        // packed line length (without the filter type byte).
+    uint8_t *previous;      // previous packed line (all 0 before the first line).
+    uint8_t *current;       // packed line.
+    uint8_t *filtered;      // filter type + filtered line, for the current and the best filter.
+};
+
+// Write the PNG signature, the header and the 16 colors palette for indexed images.
+static int png_write_header(FILE *out, uint32_t width, uint32_t height, int color_type, const uint8_t *palette) {
+    static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    uint8_t ihdr[13];
+
+    png_put32(ihdr, width);
+    png_put32(ihdr+4, height);
+    ihdr[8] = (color_type == PNG_COLOR_INDEXED) ? 4 : 8;    // bit depth
+    ihdr[9] = color_type;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    if((fwrite(signature, 1, 8, out) != 8) || !png_write_chunk(out, "IHDR", NULL, 0, ihdr, 13)) {
+        return 0;
+    }
+    return (color_type != PNG_COLOR_INDEXED) || png_write_chunk(out, "PLTE", NULL, 0, palette, 16*3);
+}
+
+static inline int png_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if((pa <= pb) && (pa <= pc)) {
+        return a;
+    }
+    return (pb <= pc) ? b : c;
+}
+
+// Filter a line and return the sum of the absolute values of the filtered bytes (as signed) used to estimate
+// which filter will compress best.
+static uint32_t png_filter_line(uint8_t *out, int type, const uint8_t *line, const uint8_t *previous, size_t len, int bpp) {
+    uint32_t sum = 0;
+    size_t i;
+
+    *out++ = type;
+    switch(type) {
+        case 1:
+            memcpy(out, line, bpp);
+            for(i=bpp; i<len; i++) {
+                out[i] = line[i] - line[i-bpp];
+            }
+            break;
+        case 2:
+            for(i=0; i<len; i++) {
+                out[i] = line[i] - previous[i];
+            }
+            break;
+        case 3:
+            for(i=0; i<(size_t)bpp; i++) {
+                out[i] = line[i] - (previous[i] >> 1);
+            }
+            for(; i<len; i++) {
+                out[i] = line[i] - ((line[i-bpp] + previous[i]) >> 1);
+            }
+            break;
+        case 4:
+            for(i=0; i<(size_t)bpp; i++) {
+                out[i] = line[i] - previous[i];
+            }
+            for(; i<len; i++) {
+                out[i] = line[i] - png_paeth(line[i-bpp], previous[i], previous[i-bpp]);
+            }
+            break;
+        default:
+            memcpy(out, line, len);
+            break;
+    }
+    for(i=0; i<len; i++) {
+        sum += abs((int8_t)out[i]);
+    }
+    return sum;
+}
+
+static void png_writer_free(struct png_writer_t *png) {
+    if(png) {
+        deflate_close(png->z);
+        free(png->previous);
+        free(png);
+    }
+}
+
+// Write the PNG header and start the image data.
+// RGB images take 3 bytes per pixel lines, indexed images (16 colors) take one palette index per pixel.
+static struct png_writer_t* png_writer_open(FILE *out, int width, int height, int color_type, const uint8_t *palette) {
+    struct png_writer_t *png;
+
+    png = (struct png_writer_t*)calloc(1, sizeof(struct png_writer_t));
+    if(png == NULL) {
+        return NULL;
+    }
+    png->out = out;
+    png->color_type = color_type;
+    png->width = width;
+    if(color_type == PNG_COLOR_INDEXED) {
+        png->bpp = 1;
+        png->line_len = (width + 1) / 2;
+    }
+    else {
+        png->bpp = 3;
+        png->line_len = width * 3;
+    }
+    png->previous = (uint8_t*)calloc(4, png->line_len + 1);
+    png->z = deflate_open(stbi_write_png_compression_level, 1, PNG_IDAT_SIZE);
+    if((png->previous == NULL) || (png->z == NULL)) {
+        png_writer_free(png);
+        return NULL;
+    }
+    png->current = png->previous + png->line_len + 1;
+    png->filtered = png->current + png->line_len + 1;
+
+    if(!png_write_header(out, width, height, color_type, palette)) {
+        png_writer_free(png);
+        return NULL;
+    }
+    return png;
+}
+
+// Write the compressed data as an IDAT chunk once enough of it is available.
+static int png_writer_flush(struct png_writer_t *png, size_t min_len) {
+    struct deflate_t *z = png->z;
+    if(z->out_len < min_len) {
+        return 1;
+    }
+    if(!png_write_chunk(png->out, "IDAT", NULL, 0, z->out, z->out_len)) {
+        return 0;
+    }
+    z->out_len = 0;
+    return 1;
+}
+
+static int png_writer_write_line(struct png_writer_t *png, const uint8_t *line) {
+    uint8_t *filtered = png->filtered;
+    uint8_t *tmp;
+    size_t len = png->line_len;
+
+    if(png->color_type == PNG_COLOR_INDEXED) {
+        png_pack_index4(png->current, line, png->width);
+        line = png->current;
+        // The filter type is always None as recommended for palette images.
+        png_filter_line(filtered, 0, line, png->previous, len, png->bpp);
+    }
+    else if(stbi_write_force_png_filter >= 0) {
+        png_filter_line(filtered, stbi_write_force_png_filter, line, png->previous, len, png->bpp);
+    }
+    else {
+        // Keep the filter giving the lowest sum of absolute differences.
+        uint8_t *best = filtered;
+        uint8_t *candidate = filtered + len + 1;
+        uint32_t best_sum = png_filter_line(best, 0, line, png->previous, len, png->bpp);
+        for(int type=1; type<5; type++) {
+            uint32_t sum = png_filter_line(candidate, type, line, png->previous, len, png->bpp);
+            if(sum < best_sum) {
+                best_sum = sum;
+                tmp = best;
+                best = candidate;
+                candidate = tmp;
+            }
+        }
+        filtered = best;
+    }
+    memcpy(png->previous, line, len);
+
+    return deflate_write(png->z, filtered, len + 1) && png_writer_flush(png, PNG_IDAT_SIZE);
+}
+
+// Write the remaining image data and the IEND chunk. The writer is released in any case.
+static int png_writer_close(struct png_writer_t *png) {
+    int ret = deflate_finish(png->z)
+           && png_writer_flush(png, 1)
+           && png_write_chunk(png->out, "IEND", NULL, 0, NULL, 0);
+    png_writer_free(png);
+    return ret;
+}
+
+static int png_begin(struct video_t *video) {
+    return video_mkdir(video);
+}
+
+static int png_frame(struct video_t *video, int k) {
+    struct header_t *header = video->header;
+    struct output_file_t *file;
+    struct png_writer_t *png;
+    uint8_t *line = video->rgb;
+    int ret = 0;
+
+    snprintf(video->filename, video->filename_len, "%04d/%06d.png", video->index, k);
+    file = output_open(video->prefix, video->filename);
+    if(file == NULL) {
+        return 0;
+    }
+    png = png_writer_open(file->out, header->width, header->height, PNG_COLOR_RGB, NULL);
+    if(png) {
+        ret = 1;
+        for(int y=0; ret && (y<header->height); y++, line+=header->width*3) {
+            ret = png_writer_write_line(png, line);
+        }
+        ret = png_writer_close(png) && ret;
+    }
+    return output_close(file) && ret;
+}
+
+static int png_duplicate(struct video_t *video, int k, int original) {
+    return video_link_frame(video, k, original, "png");
+}
+
+static int png_end(struct video_t *video) {
+    (void)video;
+    return 1;
+}
+
+// Animated PNG: one file per video (<prefix>/<index>.png) using the 16 colors palette.
+struct apng_t {
+    struct output_file_t *file;
+    FILE *out;
+    uint32_t sequence;
+    uint8_t *filtered;
+};
+
+static int apng_begin(struct video_t *video) {
+    struct header_t *header = video->header;
+    struct apng_t *apng;
+    uint8_t actl[8];
+
+    apng = (struct apng_t*)calloc(1, sizeof(struct apng_t));
+    if(apng == NULL) {
+        return 0;
+    }
+    video->state = apng;
+
+    snprintf(video->filename, video->filename_len, "%04d.png", video->index);
+    apng->file = output_open(video->prefix, video->filename);
+    if(apng->file == NULL) {
+        return 0;
+    }
+    apng->out = apng->file->out;
+    // Pixels are stored as 4 bits palette indices, each line is prefixed by its filter type.
+    apng->filtered = (uint8_t*)malloc(((header->width+1)/2 + 1) * header->height);
+    if(apng->filtered == NULL) {
+        return 0;
+    }
+
+    png_put32(actl, header->frames);
+    png_put32(actl+4, 0);   // loop forever
+
+    return png_write_header(apng->out, header->width, header->height, PNG_COLOR_INDEXED, video->palette)
+        && png_write_chunk(apng->out, "acTL", NULL, 0, actl, 8);
+}
+
+static int apng_frame(struct video_t *video, int k) {
+    struct apng_t *apng = (struct apng_t*)video->state;
+    struct header_t *header = video->header;
+    struct rect_t *rect = &video->dirty;
+    size_t line_len = (rect->width+1) / 2;
+    uint8_t fctl[26];
+    uint8_t sequence[4];
+    uint8_t *zlib;
+    int zlen;
+    int ret;
+
+    // Pack the indices of the area that changed since the last frame.
+    // The filter type is always None as recommended for palette images.
+    uint8_t *out = apng->filtered;
+    uint8_t *in = video->indexed + rect->x + rect->y*header->width;
+    for(int y=0; y<rect->height; y++, in+=header->width) {
+        *out++ = 0;
+        out = png_pack_index4(out, in, rect->width);
+    }
+
+    zlib = huvideo_zlib_compress(apng->filtered, (int)((line_len+1) * rect->height), &zlen, stbi_write_png_compression_level);
+    if(zlib == NULL) {
+        return 0;
+    }
+
+    png_put32(fctl, apng->sequence++);
+    png_put32(fctl+4, rect->width);
+    png_put32(fctl+8, rect->height);
+    png_put32(fctl+12, rect->x);
+    png_put32(fctl+16, rect->y);
+    fctl[20] = 0; fctl[21] = 1;     // delay numerator
+    fctl[22] = g_fps >> 8; fctl[23] = g_fps; // delay denominator
+    fctl[24] = 0;                   // dispose op: none (the next frame is drawn over this one)
+    fctl[25] = 0;                   // blend op: source (the area is replaced)
+
+    ret = png_write_chunk(apng->out, "fcTL", NULL, 0, fctl, 26);
+    if(ret) {
+        // The first frame is also the default image.
+        if(k == 0) {
+            ret = png_write_chunk(apng->out, "IDAT", NULL, 0, zlib, zlen);
+        }
+        else {
+            png_put32(sequence, apng->sequence++);
+            ret = png_write_chunk(apng->out, "fdAT", sequence, 4, zlib, zlen);
+        }
+    }
+    free(zlib);
+    return ret;
+}
+
+static int apng_end(struct video_t *video) {
+    struct apng_t *apng = (struct apng_t*)video->state;
+    int ret = 1;
+    if(apng) {
+        if(apng->file) {
+            ret = png_write_chunk(apng->out, "IEND", NULL, 0, NULL, 0);
+            ret = output_close(apng->file) && ret;
+        }
+        free(apng->filtered);
+        free(apng);
+        video->state = NULL;
+    }
+    return ret;
+}
+
+// Animated GIF: one file per video (<prefix>/<index>.gif) using the 16 colors palette as global color table.
+#define GIF_MAX_CODE 4096
+#define GIF_MIN_CODE_SIZE 4
+
+struct gif_t {
+    struct output_file_t *file;
+    FILE *out;
+    uint16_t *dict;         // LZW trie: dict[code*16 + index] is the code of the string code+index (0: not found).
+    uint8_t *buffer;        // encoded frame.
+    uint8_t *area;          // pixels of the area that changed since the previous frame.
+    size_t len;
+    uint32_t bits;
+    int bit_count;
+    size_t block;           // offset of the current data sub-block length byte.
+};
+
+static inline void gif_put_code(struct gif_t *gif, uint32_t code, int size) {
+    gif->bits |= code << gif->bit_count;
+    gif->bit_count += size;
+    while(gif->bit_count >= 8) {
+        // Image data is split into sub-blocks of at most 255 bytes.
+        if((gif->len - gif->block) == 256) {
+            gif->buffer[gif->block] = 255;
+            gif->block = gif->len++;
+        }
+        gif->buffer[gif->len++] = gif->bits;
+        gif->bits >>= 8;
+        gif->bit_count -= 8;
+    }
+}
+
+// LZW compress palette indices into data sub-blocks.
+static void gif_encode(struct gif_t *gif, const uint8_t *pixels, size_t count) {
+    const uint32_t clear = 1 << GIF_MIN_CODE_SIZE;
+    int size = GIF_MIN_CODE_SIZE + 1;
+    uint32_t next = clear + 2;
+    uint32_t code;
+
+    gif->buffer[gif->len++] = GIF_MIN_CODE_SIZE;
+    gif->block = gif->len++;
+    gif->bits = 0;
+    gif->bit_count = 0;
+
+    memset(gif->dict, 0, GIF_MAX_CODE * 16 * sizeof(uint16_t));
+    gif_put_code(gif, clear, size);
+
+    code = pixels[0];
+    for(size_t i=1; i<count; i++) {
+        uint8_t index = pixels[i];
+        uint16_t child = gif->dict[code*16 + index];
+        if(child) {
+            code = child;
+            continue;
+        }
+        gif_put_code(gif, code, size);
+        if(next < GIF_MAX_CODE) {
+            gif->dict[code*16 + index] = next++;
+            // The decoder is one code behind, hence the +1.
+            if(next > (1U << size)) {
+                size++;
+            }
+        }
+        else {
+            gif_put_code(gif, clear, size);
+            memset(gif->dict, 0, GIF_MAX_CODE * 16 * sizeof(uint16_t));
+            size = GIF_MIN_CODE_SIZE + 1;
+            next = clear + 2;
+        }
+        code = index;
+    }
+    gif_put_code(gif, code, size);
+    // The decoder adds an entry after the last code, and may read the end code with one more bit.
+    if((next < GIF_MAX_CODE) && (next >= (1U << size))) {
+        size++;
+    }
+    gif_put_code(gif, clear + 1, size);
+    if(gif->bit_count) {
+        gif_put_code(gif, 0, 8 - gif->bit_count);
+    }
+    // Close the last sub-block and add the block terminator.
+    gif->buffer[gif->block] = (uint8_t)(gif->len - gif->block - 1);
+    if(gif->buffer[gif->block]) {
+        gif->buffer[gif->len++] = 0;
+    }
+    else {
+        gif->len = gif->block + 1;
+        gif->buffer[gif->block] = 0;
+    }
+}
+
+static int gif_begin(struct video_t *video) {
+    struct header_t *header = video->header;
+    struct gif_t *gif;
+    uint8_t screen[13] = { 'G', 'I', 'F', '8', '9', 'a' };
+    // Loop forever.
+    static const uint8_t netscape[19] = {
+        0x21, 0xff, 0x0b, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00
+    };
+
+    gif = (struct gif_t*)calloc(1, sizeof(struct gif_t));
+    if(gif == NULL) {
+        return 0;
+    }
+    video->state = gif;
+
+    snprintf(video->filename, video->filename_len, "%04d.gif", video->index);
+    gif->file = output_open(video->prefix, video->filename);
+    if(gif->file == NULL) {
+        return 0;
+    }
+    gif->out = gif->file->out;
+    gif->dict = (uint16_t*)malloc(GIF_MAX_CODE * 16 * sizeof(uint16_t));
+    // Worst case is one 12 bits code per pixel, plus sub-block lengths and frame headers.
+    gif->buffer = (uint8_t*)malloc(header->width * header->height * 2 + 256);
+    gif->area = (uint8_t*)malloc(header->width * header->height);
+    if((gif->dict == NULL) || (gif->buffer == NULL) || (gif->area == NULL)) {
+        return 0;
+    }
+
+    screen[6] = header->width & 0xff;
+    screen[7] = header->width >> 8;
+    screen[8] = header->height & 0xff;
+    screen[9] = header->height >> 8;
+    screen[10] = 0xb3;  // global color table of 16 entries, 4 bits color resolution.
+    screen[11] = 0;     // background color index.
+    screen[12] = 0;     // pixel aspect ratio.
+
+    return (fwrite(screen, 1, 13, gif->out) == 13)
+        && (fwrite(video->palette, 1, 16*3, gif->out) == 16*3)
+        && (fwrite(netscape, 1, 19, gif->out) == 19);
+}
+
+static int gif_frame(struct video_t *video, int k) {
+    struct gif_t *gif = (struct gif_t*)video->state;
+    struct header_t *header = video->header;
+    struct rect_t *rect = &video->dirty;
+    uint16_t delay = (100 + g_fps/2) / g_fps;
+    uint8_t *out = gif->buffer;
+    uint8_t *pixels;
+    (void)k;
+
+    // Graphic control extension.
+    *out++ = 0x21; *out++ = 0xf9; *out++ = 0x04;
+    *out++ = 0x04;  // disposal method: do not dispose (the next frame only updates the area that changed).
+    *out++ = delay & 0xff;
+    *out++ = delay >> 8;
+    *out++ = 0x00;  // transparent color index (unused).
+    *out++ = 0x00;
+    // Image descriptor.
+    *out++ = 0x2c;
+    *out++ = rect->x & 0xff;
+    *out++ = rect->x >> 8;
+    *out++ = rect->y & 0xff;
+    *out++ = rect->y >> 8;
+    *out++ = rect->width & 0xff;
+    *out++ = rect->width >> 8;
+    *out++ = rect->height & 0xff;
+    *out++ = rect->height >> 8;
+    *out++ = 0x00;  // no local color table, not interlaced.
+
+    gif->len = out - gif->buffer;
+    pixels = video->indexed;
+    if((rect->width != header->width) || (rect->height != header->height)) {
+        // Gather the dirty area pixels.
+        pixels = gif->area;
+        for(int y=0; y<rect->height; y++) {
+            memcpy(pixels + y*rect->width, video->indexed + rect->x + (rect->y + y)*header->width, rect->width);
+        }
+    }
+    gif_encode(gif, pixels, rect->width * rect->height);
+
+    return fwrite(gif->buffer, 1, gif->len, gif->out) == gif->len;
+}
+
+static int gif_end(struct video_t *video) {
+    struct gif_t *gif = (struct gif_t*)video->state;
+    int ret = 1;
+    if(gif) {
+        if(gif->file) {
+            ret = (fputc(0x3b, gif->out) != EOF);
+            ret = output_close(gif->file) && ret;
+        }
+        free(gif->dict);
+        free(gif->buffer);
+        free(gif->area);
+        free(gif);
+        video->state = NULL;
+    }
+    return ret;
+}
+
+// One QOI file per frame: <prefix>/<index>/<frame>.qoi
+// See "The Quite OK Image Format" specification (https://qoiformat.org/qoi-specification.pdf).
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+
+struct qoi_t {
+    uint8_t *buffer;
+};
+
+static int qoi_begin(struct video_t *video) {
+    struct header_t *header = video->header;
+    struct qoi_t *qoi = (struct qoi_t*)calloc(1, sizeof(struct qoi_t));
+    if(qoi == NULL) {
+        return 0;
+    }
+    video->state = qoi;
+    // Worst case is 4 bytes per pixel (QOI_OP_RGB) + 14 bytes header + 8 bytes end marker.
+    qoi->buffer = (uint8_t*)malloc(header->width * header->height * 4 + 14 + 8);
+    if(qoi->buffer == NULL) {
+        return 0;
+    }
+    return video_mkdir(video);
+}
+
+// Encode a RGB8 image in a single pass. Returns the encoded size.
+static size_t qoi_encode(uint8_t *out, const uint8_t *rgb, int width, int height) {
+    uint32_t index[64];
+    uint32_t previous = 0xff000000;
+    size_t count = (size_t)width * height;
+    uint8_t *ptr = out;
+    int run = 0;
+
+    memcpy(ptr, "qoif", 4);
+    png_put32(ptr+4, width);
+    png_put32(ptr+8, height);
+    ptr[12] = 3;    // RGB
+    ptr[13] = 0;    // sRGB with linear alpha
+    ptr += 14;
+
+    memset(index, 0, sizeof(index));
+    for(size_t i=0; i<count; i++, rgb+=3) {
+        uint32_t pixel = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16) | 0xff000000;
+        if(pixel == previous) {
+            run++;
+            if((run == 62) || ((i+1) == count)) {
+                *ptr++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if(run) {
+            *ptr++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        int hash = (rgb[0]*3 + rgb[1]*5 + rgb[2]*7 + 255*11) % 64;
+        if(index[hash] == pixel) {
+            *ptr++ = QOI_OP_INDEX | hash;
+        }
+        else {
+            index[hash] = pixel;
+
+            int8_t dr = rgb[0] - (uint8_t)previous;
+            int8_t dg = rgb[1] - (uint8_t)(previous >> 8);
+            int8_t db = rgb[2] - (uint8_t)(previous >> 16);
+            int8_t dr_dg = dr - dg;
+            int8_t db_dg = db - dg;
+            if((dr > -3) && (dr < 2) && (dg > -3) && (dg < 2) && (db > -3) && (db < 2)) {
+                *ptr++ = QOI_OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+            }
+            else if((dr_dg > -9) && (dr_dg < 8) && (dg > -33) && (dg < 32) && (db_dg > -9) && (db_dg < 8)) {
+                *ptr++ = QOI_OP_LUMA | (dg + 32);
+                *ptr++ = ((dr_dg + 8) << 4) | (db_dg + 8);
+            }
+            else {
+                *ptr++ = QOI_OP_RGB;
+                *ptr++ = rgb[0];
+                *ptr++ = rgb[1];
+                *ptr++ = rgb[2];
+            }
+        }
+        previous = pixel;
+    }
+
+    memset(ptr, 0, 7);
+    ptr[7] = 1;
+    ptr += 8;
+
+    return ptr - out;
+}
+
+static int qoi_frame(struct video_t *video, int k) {
+    struct qoi_t *qoi = (struct qoi_t*)video->state;
+    struct header_t *header = video->header;
+    size_t len;
+
+    len = qoi_encode(qoi->buffer, video->rgb, header->width, header->height);
+
+    snprintf(video->filename, video->filename_len, "%04d/%06d.qoi", video->index, k);
+    return output_write_file(video->prefix, video->filename, qoi->buffer, len);
+}
+
+static int qoi_duplicate(struct video_t *video, int k, int original) {
+    return video_link_frame(video, k, original, "qoi");
+}
+
+static int qoi_end(struct video_t *video) {
+    struct qoi_t *qoi = (struct qoi_t*)video->state;
+    if(qoi) {
+        free(qoi->buffer);
+        free(qoi);
+        video->state = NULL;
+    }
+    return 1;
+}
+
+// Sprite sheet: all the frames of a video are laid out in a grid stored as a single 4 bits indexed PNG
+// (<prefix>/<index>.png). The frame rectangles are listed in <prefix>/<index>.json.
+struct atlas_t {
+    int columns;
+    int rows;
+    uint32_t width;
+    uint32_t height;
+    int row;                // number of rows of frames written so far.
+    int32_t *reference;     // cell used by each frame (duplicate frames use the cell of the original one).
+    uint8_t *band;          // palette indices of the current row of frames.
+    struct output_file_t *file;
+    struct png_writer_t *png;
+};
+
+static int atlas_begin(struct video_t *video) {
+    struct header_t *header = video->header;
+    struct atlas_t *atlas;
+
+    atlas = (struct atlas_t*)calloc(1, sizeof(struct atlas_t));
+    if(atlas == NULL) {
+        return 0;
+    }
+    video->state = atlas;
+
+    // Try to keep the atlas square.
+    for(atlas->columns=1; ((atlas->columns * header->width) < (((header->frames + atlas->columns - 1) / atlas->columns) * header->height)); atlas->columns++) {
+    }
+    atlas->rows = (header->frames + atlas->columns - 1) / atlas->columns;
+    if(atlas->rows == 0) {
+        atlas->rows = 1;
+    }
+    atlas->width = atlas->columns * header->width;
+    atlas->height = atlas->rows * header->height;
+    // Only a row of frames is kept in memory. Unused cells are left to palette entry 0.
+    atlas->band = (uint8_t*)calloc(atlas->width, header->height);
+    atlas->reference = (int32_t*)malloc((header->frames + 1) * sizeof(int32_t));
+    if((atlas->band == NULL) || (atlas->reference == NULL)) {
+        return 0;
+    }
+    for(int k=0; k<header->frames; k++) {
+        atlas->reference[k] = k;
+    }
+
+    snprintf(video->filename, video->filename_len, "%04d.png", video->index);
+    atlas->file = output_open(video->prefix, video->filename);
+    if(atlas->file == NULL) {
+        return 0;
+    }
+    atlas->png = png_writer_open(atlas->file->out, atlas->width, atlas->height, PNG_COLOR_INDEXED, video->palette);
+    return (atlas->png != NULL);
+}
+
+// Write the current row of frames to the PNG and clear it.
+static int atlas_write_band(struct video_t *video, struct atlas_t *atlas) {
+    uint8_t *line = atlas->band;
+    for(int j=0; j<video->header->height; j++, line+=atlas->width) {
+        if(!png_writer_write_line(atlas->png, line)) {
+            return 0;
+        }
+    }
+    memset(atlas->band, 0, atlas->width * video->header->height);
+    atlas->row++;
+    return 1;
+}
+
+static int atlas_frame(struct video_t *video, int k) {
+    struct atlas_t *atlas = (struct atlas_t*)video->state;
+    struct header_t *header = video->header;
+    int column = k % atlas->columns;
+    uint8_t *out = atlas->band + column * header->width;
+    uint8_t *in = video->indexed;
+    for(int j=0; j<header->height; j++, in+=header->width, out+=atlas->width) {
+        memcpy(out, in, header->width);
+    }
+    return (column < (atlas->columns-1)) || atlas_write_band(video, atlas);
+}
+
+// Duplicate frames reference the cell of the original frame, their own cell is left empty.
+static int atlas_duplicate(struct video_t *video, int k, int original) {
+    struct atlas_t *atlas = (struct atlas_t*)video->state;
+    atlas->reference[k] = original;
+    return ((k % atlas->columns) < (atlas->columns-1)) || atlas_write_band(video, atlas);
+}
+
+static int atlas_write_index(struct video_t *video, struct atlas_t *atlas) {
+    struct header_t *header = video->header;
+    struct output_file_t *file;
+    FILE *out;
+    int ret;
+
+    snprintf(video->filename, video->filename_len, "%04d.json", video->index);
+    file = output_open(video->prefix, video->filename);
+    if(file == NULL) {
+        return 0;
+    }
+    out = file->out;
+    fprintf(out, "{\n  \"image\": \"%04d.png\",\n", video->index);
+    fprintf(out, "  \"width\": %u,\n  \"height\": %u,\n", atlas->width, atlas->height);
+    fprintf(out, "  \"columns\": %d,\n  \"rows\": %d,\n", atlas->columns, atlas->rows);
+    fprintf(out, "  \"fps\": %d,\n", g_fps);
+    fprintf(out, "  \"frames\": [");
+    for(int k=0; k<header->frames; k++) {
+        int cell = atlas->reference[k];
+        fprintf(out, "%s\n    { \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d }", k ? "," : "",
+                (cell % atlas->columns) * header->width, (cell / atlas->columns) * header->height, header->width, header->height);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    ret = !ferror(out);
+    return output_close(file) && ret;
+}
+
+static int atlas_end(struct video_t *video) {
+    struct atlas_t *atlas = (struct atlas_t*)video->state;
+    int ret = 0;
+
+    if(atlas == NULL) {
+        return 1;
+    }
+    if(atlas->png) {
+        // Write the last (partial) row and pad the image if frames are missing.
+        for(ret=1; ret && (atlas->row < atlas->rows); ) {
+            ret = atlas_write_band(video, atlas);
+        }
+        ret = png_writer_close(atlas->png) && ret;
+    }
+    if(atlas->file) {
+        ret = output_close(atlas->file) && ret;
+    }
+    ret = ret && atlas_write_index(video, atlas);
+    free(atlas->reference);
+    free(atlas->band);
+    free(atlas);
+    video->state = NULL;
+    return ret;
+}
+
+// Raw frame store (see huvideo_store.h).
+static int raw_begin(struct video_t *video) {
+    struct header_t *header = video->header;
+    int pixel_format = video->rgb ? HUVIDEO_STORE_RGB : HUVIDEO_STORE_INDEXED;
+    uint32_t frame_size = header->width * header->height * ((pixel_format == HUVIDEO_STORE_RGB) ? 3 : 1);
+    uint8_t buffer[HUVIDEO_STORE_HEADER_SIZE];
+    struct output_file_t *file;
+
+    memset(buffer, 0, HUVIDEO_STORE_HEADER_SIZE);
+    memcpy(buffer, HUVIDEO_STORE_MAGIC, 8);
+    put_le16(buffer+8, HUVIDEO_STORE_VERSION);
+    put_le16(buffer+10, pixel_format);
+    put_le16(buffer+12, header->width);
+    put_le16(buffer+14, header->height);
+    put_le32(buffer+16, header->frames);
+    put_le32(buffer+20, g_fps);
+    put_le32(buffer+24, HUVIDEO_STORE_HEADER_SIZE);
+    put_le32(buffer+28, frame_size);
+    memcpy(buffer+32, video->palette, 16*3);
+
+    snprintf(video->filename, video->filename_len, "%04d.frames", video->index);
+    file = output_open(video->prefix, video->filename);
+    if(file == NULL) {
+        return 0;
+    }
+    video->state = file;
+    return output_reserve(file, HUVIDEO_STORE_HEADER_SIZE + (size_t)frame_size * header->frames)
+        && (fwrite(buffer, 1, HUVIDEO_STORE_HEADER_SIZE, file->out) == HUVIDEO_STORE_HEADER_SIZE);
+}
+
+static int raw_frame(struct video_t *video, int k) {
+    struct output_file_t *file = (struct output_file_t*)video->state;
+    size_t len = video->header->width * video->header->height;
+    (void)k;
+    if(video->rgb) {
+        return fwrite(video->rgb, 3, len, file->out) == len;
+    }
+    return fwrite(video->indexed, 1, len, file->out) == len;
+}
+
+static int raw_end(struct video_t *video) {
+    struct output_file_t *file = (struct output_file_t*)video->state;
+    video->state = NULL;
+    return (file == NULL) || output_close(file);
+}
+
+// AVI file (<prefix>/<index>.avi) with MJPEG or uncompressed frames.
+// The decoded adpcm samples, if any, are stored as a 16 bits PCM stream. Each frame is preceded by the samples
+// played until its end so that the file is written in a single pass.
+// See the AVI RIFF file reference (https://learn.microsoft.com/en-us/windows/win32/directshow/avi-riff-file-reference).
+#define AVI_JPEG_QUALITY 90
+#define AVI_HEADER_SIZE 326     // with an audio stream.
+
+#define AVIF_HASINDEX 0x10
+#define AVIF_ISINTERLEAVED 0x100
+#define AVIIF_KEYFRAME 0x10
+
+struct avi_t {
+    struct output_file_t *file;
+    FILE *out;
+    int mjpeg;
+    int error;
+    uint8_t *frame;         // encoded frame.
+    size_t frame_len;
+    size_t frame_capacity;
+    int encoded;            // index of the frame held by the frame buffer.
+    uint8_t *index;         // idx1 entries.
+    size_t index_len;
+    size_t index_capacity;
+    uint32_t movi_len;      // size of the movi list.
+    uint32_t max_chunk;
+    size_t sample;          // number of audio samples written.
+    size_t sample_count;
+};
+
+static uint8_t* avi_put_chunk(uint8_t *out, const char *tag, uint32_t size) {
+    memcpy(out, tag, 4);
+    put_le32(out+4, size);
+    return out + 8;
+}
+
+static uint8_t* avi_put_list(uint8_t *out, const char *type, uint32_t size) {
+    out = avi_put_chunk(out, "LIST", size);
+    memcpy(out, type, 4);
+    return out + 4;
+}
+
+// Build the file header up to the movi list header. Returns its size.
+static size_t avi_header(struct video_t *video, struct avi_t *avi, uint8_t *buffer) {
+    struct header_t *header = video->header;
+    uint32_t video_len = 4 + (8+56) + (8+40);
+    uint32_t audio_len = avi->sample_count ? (4 + (8+56) + (8+18)) : 0;
+    uint32_t hdrl_len = 4 + (8+56) + (8+video_len) + (audio_len ? (8+audio_len) : 0);
+    uint32_t audio_chunk = (g_audio_rate / g_fps + 1) * 2;
+    uint8_t *out = buffer;
+
+    memset(buffer, 0, AVI_HEADER_SIZE);
+    out = avi_put_chunk(out, "RIFF", 4 + (8+hdrl_len) + (8+avi->movi_len) + (8+avi->index_len));
+    memcpy(out, "AVI ", 4);
+    out = avi_put_list(out+4, "hdrl", hdrl_len);
+
+    out = avi_put_chunk(out, "avih", 56);
+    put_le32(out, 1000000 / g_fps);                 // microseconds per frame
+    put_le32(out+4, avi->max_chunk * g_fps + (avi->sample_count ? g_audio_rate * 2 : 0));
+    put_le32(out+12, AVIF_HASINDEX | AVIF_ISINTERLEAVED);
+    put_le32(out+16, header->frames);
+    put_le32(out+24, audio_len ? 2 : 1);            // streams
+    put_le32(out+28, avi->max_chunk);               // suggested buffer size
+    put_le32(out+32, header->width);
+    put_le32(out+36, header->height);
+    out += 56;
+
+    out = avi_put_list(out, "strl", video_len);
+    out = avi_put_chunk(out, "strh", 56);
+    memcpy(out, "vids", 4);
+    if(avi->mjpeg) {
+        memcpy(out+4, "MJPG", 4);
+    }
+    put_le32(out+20, 1);                            // scale
+    put_le32(out+24, g_fps);                        // rate
+    put_le32(out+32, header->frames);               // length
+    put_le32(out+36, avi->max_chunk);
+    put_le32(out+40, 0xffffffff);                   // default quality
+    put_le16(out+52, header->width);                // frame rectangle
+    put_le16(out+54, header->height);
+    out += 56;
+    out = avi_put_chunk(out, "strf", 40);           // BITMAPINFOHEADER
+    put_le32(out, 40);
+    put_le32(out+4, header->width);
+    put_le32(out+8, header->height);                // uncompressed frames are stored bottom-up.
+    put_le16(out+12, 1);                            // planes
+    put_le16(out+14, 24);                           // bits per pixel
+    if(avi->mjpeg) {
+        memcpy(out+16, "MJPG", 4);
+    }
+    put_le32(out+20, header->width * header->height * 3);
+    out += 40;
+
+    if(audio_len) {
+        out = avi_put_list(out, "strl", audio_len);
+        out = avi_put_chunk(out, "strh", 56);
+        memcpy(out, "auds", 4);
+        put_le32(out+20, 2);                        // scale (block size)
+        put_le32(out+24, g_audio_rate * 2);         // rate (bytes per second)
+        put_le32(out+32, avi->sample_count);        // length (blocks)
+        put_le32(out+36, audio_chunk);
+        put_le32(out+40, 0xffffffff);
+        put_le32(out+44, 2);                        // sample size
+        out += 56;
+        out = avi_put_chunk(out, "strf", 18);       // WAVEFORMATEX
+        put_le16(out, 1);                           // PCM
+        put_le16(out+2, 1);                         // mono
+        put_le32(out+4, g_audio_rate);
+        put_le32(out+8, g_audio_rate * 2);
+        put_le16(out+12, 2);                        // block align
+        put_le16(out+14, 16);                       // bits per sample
+        out += 18;
+    }
+
+    out = avi_put_list(out, "movi", avi->movi_len);
+    return out - buffer;
+}
+
+// Write a movi chunk and add it to the index.
+static int avi_write_chunk(struct avi_t *avi, const char *tag, const uint8_t *data, uint32_t len) {
+    uint8_t chunk[8];
+    uint8_t *entry;
+
+    if((avi->index_len + 16) > avi->index_capacity) {
+        size_t capacity = avi->index_capacity ? (2 * avi->index_capacity) : 4096;
+        uint8_t *index = (uint8_t*)realloc(avi->index, capacity);
+        if(index == NULL) {
+            return 0;
+        }
+        avi->index = index;
+        avi->index_capacity = capacity;
+    }
+    // Offsets are relative to the movi list type.
+    entry = avi->index + avi->index_len;
+    memcpy(entry, tag, 4);
+    put_le32(entry+4, AVIIF_KEYFRAME);
+    put_le32(entry+8, avi->movi_len);
+    put_le32(entry+12, len);
+    avi->index_len += 16;
+
+    // Chunks are word aligned.
+    avi->movi_len += 8 + len + (len & 1);
+    if(len > avi->max_chunk) {
+        avi->max_chunk = len;
+    }
+    avi_put_chunk(chunk, tag, len);
+    return (fwrite(chunk, 1, 8, avi->out) == 8)
+        && (fwrite(data, 1, len, avi->out) == len)
+        && (!(len & 1) || (fputc(0, avi->out) != EOF));
+}
+
+static void avi_jpeg_write(void *context, void *data, int size) {
+    struct avi_t *avi = (struct avi_t*)context;
+    if((avi->frame_len + size) > avi->frame_capacity) {
+        size_t capacity = 2 * (avi->frame_len + size);
+        uint8_t *frame = (uint8_t*)realloc(avi->frame, capacity);
+        if(frame == NULL) {
+            avi->error = 1;
+            return;
+        }
+        avi->frame = frame;
+        avi->frame_capacity = capacity;
+    }
+    memcpy(avi->frame + avi->frame_len, data, size);
+    avi->frame_len += size;
+}
+
+static int avi_encode(struct video_t *video, struct avi_t *avi) {
+    struct header_t *header = video->header;
+    if(avi->mjpeg) {
+        avi->frame_len = 0;
+        avi->error = 0;
+        return stbi_write_jpg_to_func(avi_jpeg_write, avi, header->width, header->height, 3, video->rgb, AVI_JPEG_QUALITY)
+            && !avi->error;
+    }
+    // BGR, bottom-up, lines are padded to 4 bytes.
+    size_t stride = (header->width * 3 + 3) & ~3;
+    for(int y=0; y<header->height; y++) {
+        const uint8_t *in = video->rgb + (header->height - 1 - y) * header->width * 3;
+        uint8_t *out = avi->frame + y * stride;
+        for(int x=0; x<header->width; x++, in+=3, out+=3) {
+            out[0] = in[2];
+            out[1] = in[1];
+            out[2] = in[0];
+        }
+    }
+    avi->frame_len = stride * header->height;
+    return 1;
+}
+
+// Write the samples played until the end of frame k (all the remaining ones for the last frame), then the frame.
+static int avi_write_frame(struct video_t *video, struct avi_t *avi, int k) {
+    size_t end = (size_t)(((uint64_t)(k + 1) * g_audio_rate) / g_fps);
+    if((end > avi->sample_count) || ((k + 1) >= video->header->frames)) {
+        end = avi->sample_count;
+    }
+    if(end > avi->sample) {
+        if(!avi_write_chunk(avi, "01wb", video->audio + avi->sample * 2, (end - avi->sample) * 2)) {
+            return 0;
+        }
+        avi->sample = end;
+    }
+    return avi_write_chunk(avi, avi->mjpeg ? "00dc" : "00db", avi->frame, avi->frame_len);
+}
+
+static int avi_open(struct video_t *video, int mjpeg) {
+    struct header_t *header = video->header;
+    struct avi_t *avi;
+    uint8_t buffer[AVI_HEADER_SIZE];
+    size_t len;
+
+    avi = (struct avi_t*)calloc(1, sizeof(struct avi_t));
+    if(avi == NULL) {
+        return 0;
+    }
+    video->state = avi;
+    avi->mjpeg = mjpeg;
+    avi->encoded = -1;
+    avi->movi_len = 4;
+    avi->sample_count = video->audio_len / 2;
+    avi->frame_capacity = ((header->width * 3 + 3) & ~3) * header->height;
+    avi->frame = (uint8_t*)calloc(1, avi->frame_capacity);
+    if(avi->frame == NULL) {
+        return 0;
+    }
+
+    snprintf(video->filename, video->filename_len, "%04d.avi", video->index);
+    avi->file = output_open(video->prefix, video->filename);
+    if(avi->file == NULL) {
+        return 0;
+    }
+    avi->out = avi->file->out;
+    // The sizes are updated once all the frames are written.
+    len = avi_header(video, avi, buffer);
+    return fwrite(buffer, 1, len, avi->out) == len;
+}
+
+static int avi_begin(struct video_t *video) {
+    return avi_open(video, 1);
+}
+
+static int avi_raw_begin(struct video_t *video) {
+    return avi_open(video, 0);
+}
+
+static int avi_frame(struct video_t *video, int k) {
+    struct avi_t *avi = (struct avi_t*)video->state;
+    avi->encoded = -1;
+    if(!avi_encode(video, avi)) {
+        return 0;
+    }
+    avi->encoded = k;
+    return avi_write_frame(video, avi, k);
+}
+
+// The encoded frame is written again if the frame buffer still holds it.
+static int avi_duplicate(struct video_t *video, int k, int original) {
+    struct avi_t *avi = (struct avi_t*)video->state;
+    if(original != avi->encoded) {
+        return 0;
+    }
+    return avi_write_frame(video, avi, k);
+}
+
+static int avi_end(struct video_t *video) {
+    struct avi_t *avi = (struct avi_t*)video->state;
+    uint8_t buffer[AVI_HEADER_SIZE];
+    int ret = 1;
+    if(avi) {
+        if(avi->file) {
+            long end;
+            size_t len;
+            avi_put_chunk(buffer, "idx1", avi->index_len);
+            ret = (fwrite(buffer, 1, 8, avi->out) == 8)
+               && (fwrite(avi->index, 1, avi->index_len, avi->out) == avi->index_len);
+            // Rewrite the header with the final sizes.
+            end = ftell(avi->out);
+            len = avi_header(video, avi, buffer);
+            ret = ret && (end >= 0)
+               && (fseek(avi->out, 0, SEEK_SET) == 0)
+               && (fwrite(buffer, 1, len, avi->out) == len)
+               && (fseek(avi->out, end, SEEK_SET) == 0);
+            ret = output_close(avi->file) && ret;
+        }
+        free(avi->frame);
+        free(avi->index);
+        free(avi);
+        video->state = NULL;
+    }
+    return ret;
+}
+
+static int pipe_begin(struct video_t *video) {
+    (void)video;
+    return 1;
+}
+
+static int pipe_end(struct video_t *video) {
+    (void)video;
+    return fflush(stdout) == 0;
+}
+
+static int rgb24_frame(struct video_t *video, int k) {
+    size_t len = video->header->width * video->header->height * 3;
+    (void)k;
+    return fwrite(video->rgb, 1, len, stdout) == len;
+}
+
+struct y4m_t {
+    uint8_t *planes;
+    size_t len;
+    uint8_t y[16];
+    uint8_t u[16];
+    uint8_t v[16];
+};
+
+static int y4m_begin(struct video_t *video) {
+    struct header_t *header = video->header;
+    struct y4m_t *y4m;
+
+    y4m = (struct y4m_t*)malloc(sizeof(struct y4m_t));
+    if(y4m == NULL) {
+        return 0;
+    }
+    video->state = y4m;
+    y4m->len = header->width * header->height + 2 * ((header->width+1)/2) * ((header->height+1)/2);
+    y4m->planes = (uint8_t*)malloc(y4m->len);
+    if(y4m->planes == NULL) {
+        return 0;
+    }
+
+    // There are only 16 colors. Their BT.601 (limited range) YCbCr values are computed once.
+    for(int i=0; i<16; i++) {
+        int r = video->palette[3*i], g = video->palette[3*i+1], b = video->palette[3*i+2];
+        y4m->y[i] = (( 66*r + 129*g +  25*b + 128) >> 8) + 16;
+        y4m->u[i] = ((-38*r -  74*g + 112*b + 128) >> 8) + 128;
+        y4m->v[i] = ((112*r -  94*g -  18*b + 128) >> 8) + 128;
+    }
+
+    return fprintf(stdout, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", header->width, header->height, g_fps) > 0;
+}
+
+static int y4m_frame(struct video_t *video, int k) {
+    struct y4m_t *y4m = (struct y4m_t*)video->state;
+    struct header_t *header = video->header;
+    int width = header->width, height = header->height;
+    uint8_t *out_y = y4m->planes;
+    uint8_t *out_u = out_y + width*height;
+    uint8_t *out_v = out_u + ((width+1)/2) * ((height+1)/2);
+    const uint8_t *in = video->indexed;
+    (void)k;
+
+    for(int i=0; i<(width*height); i++) {
+        *out_y++ = y4m->y[in[i]];
+    }
+    // Chroma is the average of each 2x2 block (the last line and column are repeated for odd sizes).
+    for(int y=0; y<height; y+=2) {
+        const uint8_t *l0 = in + y*width;
+        const uint8_t *l1 = ((y+1) < height) ? (l0 + width) : l0;
+        for(int x=0; x<width; x+=2) {
+            int x1 = ((x+1) < width) ? (x+1) : x;
+            *out_u++ = (y4m->u[l0[x]] + y4m->u[l0[x1]] + y4m->u[l1[x]] + y4m->u[l1[x1]] + 2) >> 2;
+            *out_v++ = (y4m->v[l0[x]] + y4m->v[l0[x1]] + y4m->v[l1[x]] + y4m->v[l1[x1]] + 2) >> 2;
+        }
+    }
+    return (fwrite("FRAME\n", 1, 6, stdout) == 6) && (fwrite(y4m->planes, 1, y4m->len, stdout) == y4m->len);
+}
+
+static int y4m_end(struct video_t *video) {
+    struct y4m_t *y4m = (struct y4m_t*)video->state;
+    if(y4m) {
+        free(y4m->planes);
+        free(y4m);
+        video->state = NULL;
+    }
+    return pipe_end(video);
+}
+
+static int png_pipe_frame(struct video_t *video, int k) {
+    struct header_t *header = video->header;
+    struct png_writer_t *png;
+    uint8_t *line = video->rgb;
+    int ret = 1;
+    (void)k;
+
+    png = png_writer_open(stdout, header->width, header->height, PNG_COLOR_RGB, NULL);
+    if(png == NULL) {
+        return 0;
+    }
+    for(int y=0; ret && (y<header->height); y++, line+=header->width*3) {
+        ret = png_writer_write_line(png, line);
+    }
+    return png_writer_close(png) && ret;
+}
+
+static const struct output_format_t g_output_formats[] = {
+    { "png",  OUTPUT_RGB | OUTPUT_FILES,     png_begin,  png_frame,  png_end,  png_duplicate },
+    { "apng", OUTPUT_INDEXED | OUTPUT_DELTA, apng_begin, apng_frame, apng_end, NULL },
+    { "gif",  OUTPUT_INDEXED | OUTPUT_DELTA, gif_begin,  gif_frame,  gif_end,  NULL },
+    { "qoi",  OUTPUT_RGB | OUTPUT_FILES,     qoi_begin,  qoi_frame,  qoi_end,  qoi_duplicate },
+    { "atlas", OUTPUT_INDEXED,               atlas_begin, atlas_frame, atlas_end, atlas_duplicate },
+    { "raw",  OUTPUT_INDEXED,                raw_begin,  raw_frame,  raw_end,  NULL },
+    { "raw-rgb", OUTPUT_RGB,                 raw_begin,  raw_frame,  raw_end,  NULL },
+    { "avi",  OUTPUT_RGB | OUTPUT_AUDIO,     avi_begin,  avi_frame,  avi_end,  avi_duplicate },
+    { "avi-raw", OUTPUT_RGB | OUTPUT_AUDIO,  avi_raw_begin, avi_frame, avi_end, avi_duplicate },
+    { NULL,   0,                             NULL,       NULL,       NULL,     NULL }
+};
+
+// Formats streaming the frames of a single video to the standard output (--pipe).
+static const struct output_format_t g_pipe_formats[] = {
+    { "rgb24", OUTPUT_RGB | OUTPUT_PIPE,     pipe_begin, rgb24_frame,    pipe_end, NULL },
+    { "y4m",   OUTPUT_INDEXED | OUTPUT_PIPE, y4m_begin,  y4m_frame,      y4m_end,  NULL },
+    { "png",   OUTPUT_RGB | OUTPUT_PIPE,     pipe_begin, png_pipe_frame, pipe_end, NULL },
+    { NULL,    0,                            NULL,       NULL,           NULL,     NULL }
+};
+
+static const struct output_format_t *g_output_format = &g_output_formats[0];
+
+// Number of sectors between the video header and the first frame (palettes and adpcm data).
+// Madden videos that are neither 128x128 nor 256x112 are stored as sprites.
+static int32_t video_layout(int game_id, struct header_t *header) {
+    int32_t skip_sector_count = 0;
+    // Found by trial and error.
+    if(game_id == PowerGolf2) {
+        skip_sector_count = 8;
+    }
+    else {
+        // Madden
+        if((header->width == 0x80) && (header->height == 0x80)) {
+            skip_sector_count = header->unknown[0];
+        }
+        else if((header->width == 0x100) && (header->height == 0x70)) {
+            skip_sector_count = 0x4;
+        }
+        else {
+            header->format = SPR;
+            skip_sector_count = header->unknown[0];
+        }
+    }
+    return skip_sector_count;
+}
+
+// Number of sectors spanned by a video (its adpcm data or its frames, whichever ends last).
+// The adpcm data only counts for the videos whose samples are extracted (see extract).
+static size_t video_extent(int game_id, struct header_t *header) {
+    struct header_t layout = *header;
+    size_t sectors_per_frame = ((header->width * header->height / 2) + 2047) / 2048;
+    size_t frames_sectors = video_layout(game_id, &layout) + header->frames * sectors_per_frame;
+    int adpcm = (game_id == Madden) && ((header->width != 0x100) && (header->height != 0x70));
+    size_t adpcm_sectors = adpcm ? adpcm_extent(header) : 0;
+    return (adpcm_sectors > frames_sectors) ? adpcm_sectors : frames_sectors;
+}
+
+// Output cache.
+// The key of each extracted video (a checksum of its sectors and of the settings changing the output) is
+// stored in the output directory manifest. A video is skipped if its key did not change since the last run.
+// CACHE_VERSION must be incremented whenever the decoder output changes.
+#define CACHE_VERSION 2
+#define CACHE_MANIFEST "huvideo.manifest"
+#define CACHE_KEY_LEN 24
+
+struct cache_entry_t {
+    int32_t index;
+    char key[CACHE_KEY_LEN+1];
+    char format[16];
+};
+
+static struct cache_entry_t *g_cache = NULL;
+static int g_cache_count = 0;
+static int g_cache_capacity = 0;
+static int g_cache_skip = 1;          // skip up to date videos (--no-cache clears it).
+
+// The manifest is only used when writing to an output directory.
+static int cache_active() {
+    return !g_tar && (g_output_dir >= 0);
+}
+
+static struct cache_entry_t* cache_find(int32_t index) {
+    for(int i=0; i<g_cache_count; i++) {
+        if(g_cache[i].index == index) {
+            return &g_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static int cache_set(int32_t index, const char *key, const char *format) {
+    struct cache_entry_t *entry = cache_find(index);
+    if(entry == NULL) {
+        if(g_cache_count == g_cache_capacity) {
+            int capacity = g_cache_capacity ? (g_cache_capacity * 2) : 64;
+            struct cache_entry_t *cache = (struct cache_entry_t*)realloc(g_cache, capacity * sizeof(struct cache_entry_t));
+            if(cache == NULL) {
+                return 0;
+            }
+            g_cache = cache;
+            g_cache_capacity = capacity;
+        }
+        entry = &g_cache[g_cache_count++];
+        entry->index = index;
+    }
+    snprintf(entry->key, sizeof(entry->key), "%s", key);
+    snprintf(entry->format, sizeof(entry->format), "%s", format);
+    return 1;
+}
+
+// Load the manifest of a previous run. A missing manifest is not an error.
+int cache_load(const char *prefix) {
+    char line[128];
+    FILE *in;
+    int fd;
+
+    if(!cache_active()) {
+        return 1;
+    }
+    fd = openat(g_output_dir, CACHE_MANIFEST, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return 1;
     }
-    if((header->height < 1) || (header->height >512)) {
-        fprintf(stderr, "invalid frame height.\n");
+    in = fdopen(fd, "rb");
+    if(in == NULL) {
+        close(fd);
         return 0;
     }
-    n_read = fread(&header->flag, 1, 1, in);
-    if(n_read != 1) {
-        fprintf(stderr, "failed to read palette flag.\n");
-        return 0;
+    while(fgets(line, sizeof(line), in)) {
+        char key[CACHE_KEY_LEN+1];
+        char format[16];
+        int32_t index;
+        if((sscanf(line, "%d %24s %15s", &index, key, format) == 3) && (strlen(key) == CACHE_KEY_LEN)) {
+            cache_set(index, key, format);
+        }
+        else {
+            fprintf(stderr, "ignoring invalid line in %s/%s\n", prefix, CACHE_MANIFEST);
+        }
     }
-    n_read = fread(&header->format, 1, 1, in);
-    if(n_read != 1) {
-        fprintf(stderr, "failed to read format.\n");
-        return 0;
+    fclose(in);
+    return 1;
+}
+
+// Rewrite the manifest. The new one replaces the old one only once it is complete.
+int cache_save(const char *prefix) {
+    struct output_file_t *file;
+    int ret;
+
+    if(!cache_active()) {
+        return 1;
     }
-    if(header->format > 1) {
-        fprintf(stderr, "invalid format.\n");
+    file = output_open(prefix, CACHE_MANIFEST ".tmp");
+    if(file == NULL) {
         return 0;
     }
-    n_read = fread(&header->adpcm_len, 1, 2, in);
-    if(n_read != 2) {
-        fprintf(stderr, "failed to read adpcm length.\n");
-        return 0;
+    for(int i=0; i<g_cache_count; i++) {
+        if(g_cache[i].key[0] == '\0') {
+            continue;
+        }
+        fprintf(file->out, "%04d %s %s\n", g_cache[i].index, g_cache[i].key, g_cache[i].format);
     }
-    // The next 6 bytes are unknown.
-    n_read = fread(&header->unknown, 1, 6, in);
-    if(n_read != 6) {
-        fprintf(stderr, "failed to read the header end.\n");
+    ret = !ferror(file->out);
+    ret = output_close(file) && ret;
+    if(ret && (renameat(g_output_dir, CACHE_MANIFEST ".tmp", g_output_dir, CACHE_MANIFEST) < 0)) {
+        fprintf(stderr, "failed to write %s/%s: %s\n", prefix, CACHE_MANIFEST, strerror(errno));
+        ret = 0;
+    }
+    return ret;
+}
+
+void cache_close() {
+    free(g_cache);
+    g_cache = NULL;
+    g_cache_count = g_cache_capacity = 0;
+}
+
+// Check if a video has to be extracted. If its output was produced by a previous run, its manifest entry is
+// removed until the new extraction is complete.
+static int cache_check(const char *prefix, int32_t index, const char *key) {
+    struct cache_entry_t *entry = cache_find(index);
+    if(entry == NULL) {
+        return 1;
+    }
+    if(g_cache_skip && (strcmp(entry->key, key) == 0)) {
         return 0;
     }
-    return 1;
+    entry->key[0] = '\0';
+    return cache_save(prefix);
 }
 
-// Convert PCE tile vram data to RGB8.
-void tile_to_rgb8(uint8_t *rgb, uint8_t *vram, uint8_t *palette, struct header_t *header) {
-    uint16_t tile_w = header->width / 8;
-    uint16_t tile_h = header->height / 8;
-    uint32_t rgb_line_stride = header->width * 3;
+// Compute the cache key of a video from the sectors it spans (palette, adpcm and frames) and the settings.
+static int cache_key(const struct demux_t *demux, int game_id, char *key) {
+    char settings[128];
+    uint32_t crc, adler;
 
-    for(int j=0; j<tile_h; j++) {
-        for(int i=0; i<tile_w; i++) {
-            uint8_t *pce_tile = vram + (i + j*tile_w) * 32;
-            uint8_t *out_tile = rgb + (i + j*header->width) * 8 * 3;
-            for(int y=0; y<8; y++, pce_tile+=2, out_tile+=rgb_line_stride) {
-                uint8_t b0 = pce_tile[0];
-                uint8_t b1 = pce_tile[1];
-                uint8_t b2 = pce_tile[16];
-                uint8_t b3 = pce_tile[17];
+    snprintf(settings, sizeof(settings), "%d %s %d %d %d %d %s %d", CACHE_VERSION, g_output_format->name, game_id,
+             stbi_write_png_compression_level, stbi_write_force_png_filter, g_fps, g_audio_extension[g_audio_format], g_audio_rate);
+    crc = crc32_update(0, (const uint8_t*)settings, strlen(settings));
+    adler = adler32(1, (const uint8_t*)settings, strlen(settings));
 
-                uint8_t *out = out_tile + 7*3;
-                for(int x=0; x<8; x++, out-=3) {
-                    uint8_t index = (b0&1) | ((b1&1)<<1) | ((b2&1)<<2) | ((b3&1)<<3);
-                    out[0] = palette[3*index];
-                    out[1] = palette[3*index+1];
-                    out[2] = palette[3*index+2];
+    // The video may be truncated (end of the image).
+    int stage = stats_stage(STAGE_HASH);
+    crc = crc32_update(crc, demux->data, demux->len);
+    adler = adler32(adler, demux->data, demux->len);
+    stats_stage(stage);
 
-                    b0 >>= 1;
-                    b1 >>= 1;
-                    b2 >>= 1;
-                    b3 >>= 1;
-                }
-            }
-        }
-    }
+    snprintf(key, CACHE_KEY_LEN+1, "%08x%08x%08x", crc, adler, (uint32_t)demux->len);
+    return 1;
 }
 
-// Convert PCE sprite vram data to RGB8 (only supports 32*64 sprite size).
-void sprite_to_rgb8(uint8_t *rgb, uint8_t *vram, uint8_t *palette, struct header_t *header) {
-    uint16_t sprite_w = header->width / 16;
-    uint16_t sprite_h = header->height / 16;
-    uint32_t rgb_line_stride = header->width * 3;
-
-    for(int j=0; j<sprite_h; j++) {
-        for(int i=0; i<sprite_w; i++) {
-            uint16_t *pce_sprite = (uint16_t*)(vram + (i + j*sprite_w) * 0x80);
-            
-            int u = ((i & 1) * 16) + (j * 32);
-            int v = (i >> 1) * 16;
-            uint8_t *out_sprite = rgb + (u + v*header->width) * 3;
-            for(int y=0; y<16; y++, pce_sprite+=1, out_sprite+=rgb_line_stride) {
-                uint16_t w0 = pce_sprite[0];
-                uint16_t w1 = pce_sprite[16];
-                uint16_t w2 = pce_sprite[32];
-                uint16_t w3 = pce_sprite[48];
+// Checkpoint journal (--resume).
+// Every frame file (formats writing a file per frame) and every video are recorded in an append-only journal
+// once their output is complete. Each record is a single line written with a single write call.
+//   huvideo-journal <version> <image size> <settings> <image>
+//   frame <video index> <frame>
+//   done <video index> <cache key or ->
+// The video index is the sector of its header. The scan resumes on the next sector, so that a resumed run probes
+// the same sectors as a complete one.
+#define JOURNAL_FILENAME "huvideo.journal"
 
-                uint8_t *out = out_sprite + 15*3;
-                for(int x=0; x<16; x++, out-=3) {
-                    uint8_t index = (w0&1) | ((w1&1)<<1) | ((w2&1)<<2) | ((w3&1)<<3);
-                    out[0] = palette[3*index];
-                    out[1] = palette[3*index+1];
-                    out[2] = palette[3*index+2];
+static int g_journal = -1;
+static int g_resume = 0;
+static int64_t g_resume_sector = 0;     // first sector to scan.
+static int32_t g_resume_index = -1;     // partially extracted video.
+static int g_resume_frames = 0;         // number of frames of g_resume_index already written.
 
-                    w0 >>= 1;
-                    w1 >>= 1;
-                    w2 >>= 1;
-                    w3 >>= 1;
-                }
-            }
-        }
+static int journal_write(const char *line) {
+    int stage;
+    int ret = 1;
+    if(g_journal < 0) {
+        return 1;
     }
+    stage = stats_stage(STAGE_WRITE);
+    if(!output_write_fd(g_journal, line, strlen(line)) || ((g_fsync == FSYNC_FILE) && (fsync(g_journal) < 0))) {
+        fprintf(stderr, "failed to write %s: %s\n", JOURNAL_FILENAME, strerror(errno));
+        ret = 0;
+    }
+    stats_stage(stage);
+    return ret;
 }
 
-int extract_adpcm(FILE *in, int64_t offset, int game_id, struct header_t *header, const char *filename) {
-    uint8_t *buffer;
-    FILE *out;
-    size_t remaining;
-    size_t start;
-    int ret;
+static int journal_frame(int32_t index, int k) {
+    char line[64];
+    snprintf(line, sizeof(line), "frame %04d %d\n", index, k);
+    return journal_write(line);
+}
 
-    out = fopen(filename, "wb");
-    if(out == NULL) {
-        fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
-        return EXIT_FAILURE;
-    }
+static int journal_done(int32_t index, const char *key) {
+    char line[64];
+    snprintf(line, sizeof(line), "done %04d %s\n", index, key);
+    return journal_write(line);
+}
 
-    buffer = (uint8_t*)malloc(2048);
+// Read the journal of a previous run with the same image and settings, and find where to resume.
+static int journal_read(const char *prefix, const char *header) {
+    char line[1024];
+    int32_t done = -1;
+    int complete = 1;
+    FILE *in;
+    int fd;
 
-    ret = EXIT_SUCCESS;
-    start = 0x40;
-    for(remaining = header->adpcm_len; (remaining > 0) && (ret == EXIT_SUCCESS); offset += g_sector_size) {
-        size_t count;
-        size_t n_read;
-
-        fseek(in, offset, SEEK_SET);
-        
-        count = (remaining >= 2048) ? 2048 : remaining;
-        n_read = fread(buffer, 1, count, in);
-        if(n_read != count) {
-            fprintf(stderr, "failed to read %ld bytes from %s: %s\n", count, filename, strerror(errno));
-            ret = EXIT_FAILURE;
+    fd = openat(g_output_dir, JOURNAL_FILENAME, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return 1;
+    }
+    in = fdopen(fd, "rb");
+    if(in == NULL) {
+        close(fd);
+        return 1;
+    }
+    if((fgets(line, sizeof(line), in) == NULL) || strcmp(line, header)) {
+        fprintf(stderr, "%s/%s was written for another image or other settings, starting over.\n", prefix, JOURNAL_FILENAME);
+        fclose(in);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), in)) {
+        char key[CACHE_KEY_LEN+1];
+        int32_t index;
+        int k;
+        // An incomplete last line (interrupted write) is ignored.
+        if(line[strlen(line)-1] != '\n') {
+            complete = 0;
+            break;
+        }
+        if(sscanf(line, "frame %d %d", &index, &k) == 2) {
+            if(index != g_resume_index) {
+                g_resume_index = index;
+                g_resume_frames = 0;
+            }
+            if((k+1) > g_resume_frames) {
+                g_resume_frames = k+1;
+            }
+        }
+        else if(sscanf(line, "done %d %24s", &index, key) == 2) {
+            done = index;
+            if((strlen(key) == CACHE_KEY_LEN) && !cache_set(index, key, g_output_format->name)) {
+                break;
+            }
         }
+    }
+    fclose(in);
+
+    if(done >= 0) {
+        g_resume_sector = done + 1;
+        fprintf(stderr, "resuming after video %04d\n", done);
+    }
+    if(g_resume_index <= done) {
+        g_resume_index = -1;
+        g_resume_frames = 0;
+    }
+    return complete;
+}
 
-        fwrite(buffer+start, 1, count - start, out);
+// Open the journal. Unless the extraction is resumed, a new journal is started.
+int journal_open(const char *prefix, const char *image, size_t image_size, int game_id) {
+    char header[1024];
+    int complete = 1;
+    int resumed;
 
-        remaining -= (n_read - start);
-        start = 0;
+    if(!g_resume || g_tar || (g_output_dir < 0)) {
+        return 1;
     }
-    
-    fclose(out);
-    free(buffer);
+    snprintf(header, sizeof(header), "huvideo-journal %d %llu %s %d %d %d %d %s %d %s\n", CACHE_VERSION, (unsigned long long)image_size,
+             g_output_format->name, game_id, stbi_write_png_compression_level, stbi_write_force_png_filter, g_fps,
+             g_audio_extension[g_audio_format], g_audio_rate, image);
+    complete = journal_read(prefix, header);
+    resumed = (g_resume_sector > 0) || (g_resume_index >= 0);
+    g_journal = openat(g_output_dir, JOURNAL_FILENAME, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resumed ? 0 : O_TRUNC), 0644);
+    if(g_journal < 0) {
+        fprintf(stderr, "failed to open %s/%s: %s\n", prefix, JOURNAL_FILENAME, strerror(errno));
+        return 0;
+    }
+    if(resumed) {
+        // Terminate the line of an interrupted write.
+        return complete || journal_write("\n");
+    }
+    return journal_write(header);
+}
 
+int journal_close() {
+    int ret = 1;
+    if(g_journal >= 0) {
+        ret = (close(g_journal) == 0);
+        g_journal = -1;
+    }
     return ret;
 }
 
-int extract(FILE *in, int32_t index, int64_t offset, int game_id, struct header_t *header, const char *prefix) {
-    uint8_t palette[16*3];
+// Run summary.
+static int64_t g_video_count = 0;
+static int64_t g_frame_count = 0;
+static int64_t g_duplicate_count = 0;
+static int64_t g_tile_lookups = 0;
+static int64_t g_tile_hits = 0;
+
+int extract(const struct demux_t *demux, int32_t index, int game_id, struct header_t *header, const char *prefix) {
+    const struct output_format_t *format = g_output_format;
+    struct video_t video;
     uint8_t buffer[0x20];
 
-    uint8_t *vram_data;
     size_t vram_data_size; 
-    size_t n_read;
-    uint8_t *img;
+    size_t frame_sectors;
+    int ret;
 
-    size_t filename_len;
-    char *filename;
+    memset(&video, 0, sizeof(video));
+    video.index = index;
+    video.header = header;
+    video.prefix = prefix;
 
     // Allocate output filename buffer.
-    filename_len = strlen(prefix) + 32;
-    filename = (char*)malloc(filename_len);
-
-    // Create outputdirectory.
-    snprintf(filename, filename_len, "%s/%04d", prefix, index);
-    mkdir(filename, 0755);
+    video.filename_len = strlen(prefix) + 32;
+    video.filename = (char*)malloc(video.filename_len);
 
     // Read palette
-    fseek(in, offset + 0x20, SEEK_SET);
-    n_read = fread(buffer, 1, 0x20, in);
-    if(n_read != 0x20) {
+    if(!demux_copy(demux, 0, 0x20, buffer, 0x20)) {
         fprintf(stderr, "failed to read palette\n");
+        free(video.filename);
         return EXIT_FAILURE;
     }
 
     // [todo] use a fixed LUT instead.
     for(int i=0; i<16; i++) {
-        palette[i*3  ] = 255 * ((buffer[2*i] >> 3) & 0x7) / 7;
-        palette[i*3+1] = 255 * (((buffer[2*i] >> 6) & 0x07) | ((buffer[2*i+1] & 0x07) << 2)) / 7;
-        palette[i*3+2] = 255 * (buffer[2*i] & 0x07) / 7;
+        video.palette[i*3  ] = 255 * ((buffer[2*i] >> 3) & 0x7) / 7;
+        video.palette[i*3+1] = 255 * (((buffer[2*i] >> 6) & 0x07) | ((buffer[2*i+1] & 0x07) << 2)) / 7;
+        video.palette[i*3+2] = 255 * (buffer[2*i] & 0x07) / 7;
     }
 
-    int32_t skip_sector_count = 0;
-    // Found by trial and error.
-    if(game_id == PowerGolf2) {
-        skip_sector_count = 8;
-    }
-    else {
-        // Madden
-        if((header->width == 0x80) && (header->height == 0x80)) {
-            skip_sector_count = header->unknown[0];
-        }
-        else if((header->width == 0x100) && (header->height == 0x70)) {
-            skip_sector_count = 0x4;
-        }
-        else {
-            header->format = SPR;
-            skip_sector_count = header->unknown[0];
-        }
-    }
+    int32_t skip_sector_count = video_layout(game_id, header);
 
     // extract adpcm
+    g_trace.video = index;
+    g_trace.frame = -1;
+    int stage = stats_stage(STAGE_AUDIO);
     if((game_id == Madden) && ((header->width != 0x100) && (header->height != 0x70))) {
-        snprintf(filename, filename_len, "%s/%04d.vox", prefix, index);
-        (void)extract_adpcm(in, offset, game_id, header, filename);
+        if(format->flags & OUTPUT_AUDIO) {
+            // The samples are read before the frames and muxed by the output format.
+            video.audio = adpcm_load(demux, header, 1, 0, &video.audio_len);
+        }
+        else if(!(format->flags & OUTPUT_PIPE)) {
+            snprintf(video.filename, video.filename_len, "%04d.%s", index, g_audio_extension[g_audio_format]);
+            (void)extract_adpcm(demux, header, prefix, video.filename);
+        }
     }
 
-    // Skip what should have been palettes and adpcm data.
-    fseek(in, offset + g_sector_size*skip_sector_count, SEEK_SET);
-
     // Read tiles.
-    img = (uint8_t*)malloc(header->width*header->height*3);
+    if(format->flags & OUTPUT_RGB) {
+        video.rgb = (uint8_t*)malloc(header->width*header->height*3);
+    }
+    if(format->flags & OUTPUT_INDEXED) {
+        video.indexed = (uint8_t*)malloc(header->width*header->height);
+    }
     vram_data_size = header->width*header->height*32/64;
-    vram_data = (uint8_t*)malloc(vram_data_size);
+    frame_sectors = (vram_data_size + 2047) / 2048;
+    video.vram = (uint8_t*)malloc(vram_data_size);
+    if(format->flags & OUTPUT_DELTA) {
+        video.previous = (uint8_t*)malloc(vram_data_size);
+    }
+    if(video.rgb && (header->format == BG)) {
+        video.tiles = (struct tile_cache_t*)calloc(1, sizeof(struct tile_cache_t));
+    }
+    video.hash = (uint32_t*)malloc(2 * (header->frames + 1) * sizeof(uint32_t));
+    video.first = (int32_t*)malloc((header->frames + 1) * sizeof(int32_t));
 
-    for(int k=0; k<header->frames; k++) {
+    // Skip the frames written before the previous run was interrupted (--resume).
+    int first = 0;
+    if((index == g_resume_index) && (format->flags & OUTPUT_FILES)) {
+        first = (g_resume_frames < header->frames) ? g_resume_frames : header->frames;
+    }
+
+    // Index of the frame held by the rgb and indexed buffers.
+    int converted = -1;
+
+    stats_stage(STAGE_ENCODE);
+    ret = format->begin(&video) ? EXIT_SUCCESS : EXIT_FAILURE;
+    for(int k=first; (k<header->frames) && (ret == EXIT_SUCCESS); k++) {
+        int original;
+        int written = 0;
+        // The frames follow the palettes and adpcm data.
+        g_trace.frame = k;
+        stats_stage(STAGE_READ);
+        size_t sector = skip_sector_count + (size_t)k * frame_sectors;
         size_t remaining;
-        uint8_t *ptr = vram_data;
-        for(remaining = vram_data_size; remaining>=2048; remaining -= 2048) {
-            n_read = fread(ptr, 1, 2048, in);
-            if(n_read != 2048) {
-                fprintf(stderr, "failed to read sector %d: %s", k, strerror(errno));
-                memset(ptr+n_read, 0, 2048-n_read);
-            }
-            fseek(in, 0x130, SEEK_CUR);
-            ptr += 2048;
+        uint8_t *ptr = video.vram;
+        int complete = 1;
+        for(remaining = vram_data_size; remaining > 0; sector++) {
+            size_t count = (remaining >= 2048) ? 2048 : remaining;
+            complete = demux_copy(demux, sector, 0, ptr, count) && complete;
+            ptr += count;
+            remaining -= count;
+        }
+        if(!complete) {
+            fprintf(stderr, "failed to read frame %d of video %04d (end of image)\n", k, index);
+        }
+
+        // Identical frames are only converted and encoded once.
+        stats_stage(STAGE_HASH);
+        original = frame_duplicate(&video, demux, skip_sector_count, frame_sectors, k, vram_data_size);
+        stats_stage(STAGE_ENCODE);
+        if(original >= 0) {
+            g_duplicate_count++;
+            written = format->duplicate && format->duplicate(&video, k, original);
         }
-        if(remaining) {
-            n_read = fread(ptr, 1, remaining, in);
-            if(n_read != remaining) {
-                fprintf(stderr, "failed to read sector %d: %s", k, strerror(errno));
-                memset(ptr+n_read, 0, remaining-n_read);
+        if(!written) {
+            // The buffers may already hold the same frame.
+            int content = (original >= 0) ? original : k;
+            if(content != converted) {
+                stats_stage(STAGE_CONVERT);
+                if(header->format == BG) {
+                    // Convert from PCE planar vram tile to rgb8 and/or palette indices.
+                    if(video.rgb) {
+                        tile_to_rgb8(video.rgb, video.vram, video.palette, header, video.tiles);
+                    }
+                    if(video.indexed) {
+                        tile_to_index8(video.indexed, video.vram, header);
+                    }
+                }
+                else {
+                    // Convert from PCE planar sprite tiles to rgb8 and/or palette indices.
+                    if(video.rgb) {
+                        sprite_to_rgb8(video.rgb, video.vram, video.palette, header);
+                    }
+                    if(video.indexed) {
+                        sprite_to_index8(video.indexed, video.vram, header);
+                    }
+                }
+                converted = content;
+                stats_stage(STAGE_ENCODE);
+            }
+
+            if(video.previous) {
+                frame_delta(&video, k, &video.dirty);
             }
-            fseek(in, g_sector_size-remaining, SEEK_CUR);
+            written = format->frame(&video, k);
         }
 
-        if(header->format == BG) {
-            // Convert from PCE planar vram tile to rgb8.
-            tile_to_rgb8(img, vram_data, palette, header);
+        if(!written) {
+            fprintf(stderr, "failed to write frame %d of video %04d\n", k, index);
+            ret = EXIT_FAILURE;
         }
-        else {
-            // Convert from PCE planar sprite tiles to rgb8.
-            sprite_to_rgb8(img, vram_data, palette, header);
+        else if((format->flags & OUTPUT_FILES) && !journal_frame(index, k)) {
+            ret = EXIT_FAILURE;
         }
+        g_frame_count++;
 
-        snprintf(filename, filename_len, "%s/%04d/%06d.png", prefix, index, k);
-        stbi_write_png(filename, header->width, header->height, 3, img, 0);
+        if(video.previous) {
+            memcpy(video.previous, video.vram, vram_data_size);
+        }
     }
+    g_trace.frame = -1;
+    stats_stage(STAGE_ENCODE);
+    if(!format->end(&video)) {
+        ret = EXIT_FAILURE;
+    }
+    stats_stage(stage);
+    g_trace.video = -1;
 
-    free(filename);
-    free(img);
-    free(vram_data);
+    free(video.filename);
+    free(video.rgb);
+    free(video.indexed);
+    free(video.vram);
+    free(video.previous);
+    free(video.hash);
+    free(video.first);
+    free(video.audio);
+    if(video.tiles) {
+        g_tile_lookups += video.tiles->lookups;
+        g_tile_hits += video.tiles->hits;
+        free(video.tiles);
+    }
 
-    return EXIT_SUCCESS;
+    return ret;
 }
 
+enum OptionID {
+    OPTION_PNG_LEVEL = 0x100,
+    OPTION_PNG_FILTER,
+    OPTION_FORMAT,
+    OPTION_FPS,
+    OPTION_ATLAS,
+    OPTION_TAR,
+    OPTION_PIPE,
+    OPTION_FSYNC,
+    OPTION_PREALLOCATE,
+    OPTION_NO_CACHE,
+    OPTION_RESUME,
+    OPTION_AUDIO,
+    OPTION_RATE,
+    OPTION_BENCH_KERNELS,
+    OPTION_STATS,
+    OPTION_TRACE,
+    OPTION_IO_REPORT
+};
+
 void usage() {
-    fprintf(stderr, "huvideo_decode -o/--offset N -g/--game G in output_directory\n");
+    fprintf(stderr, "huvideo_decode -o/--offset N -g/--game G [--format png|apng|gif|qoi|atlas|raw|raw-rgb|avi|avi-raw] [--atlas] [--tar file|-] [--pipe rgb24|y4m|png] [--fsync none|file|end] [--preallocate] [--no-cache] [--resume] [--audio vox|wav|pcm] [--rate N] [--bench-kernels[=runs]] [--stats[=file.json]] [--trace file.json] [--io-report] [--fps N] [--png-level L] [--png-filter F] in [output_directory]\n");
 }
 
 int main(int argc, char **argv) {
@@ -344,6 +4787,23 @@ int main(int argc, char **argv) {
     const struct option options[] = {
         {"offset",  optional_argument, 0, 'o' },
         {"game",    optional_argument, 0, 'g' },
+        {"png-level",  required_argument, 0, OPTION_PNG_LEVEL },
+        {"png-filter", required_argument, 0, OPTION_PNG_FILTER },
+        {"format",     required_argument, 0, OPTION_FORMAT },
+        {"fps",        required_argument, 0, OPTION_FPS },
+        {"atlas",      no_argument,       0, OPTION_ATLAS },
+        {"tar",        required_argument, 0, OPTION_TAR },
+        {"pipe",       required_argument, 0, OPTION_PIPE },
+        {"fsync",      required_argument, 0, OPTION_FSYNC },
+        {"preallocate", no_argument,      0, OPTION_PREALLOCATE },
+        {"no-cache",   no_argument,       0, OPTION_NO_CACHE },
+        {"resume",     no_argument,       0, OPTION_RESUME },
+        {"audio",      required_argument, 0, OPTION_AUDIO },
+        {"rate",       required_argument, 0, OPTION_RATE },
+        {"bench-kernels", optional_argument, 0, OPTION_BENCH_KERNELS },
+        {"stats",      optional_argument, 0, OPTION_STATS },
+        {"trace",      required_argument, 0, OPTION_TRACE },
+        {"io-report",  no_argument,       0, OPTION_IO_REPORT },
         {0,         0,                 0,  0 }
     };
 
@@ -357,7 +4817,14 @@ int main(int argc, char **argv) {
     int64_t offset = -1; 
     int game_id = PowerGolf2;
 
-    int ret;
+    const char *tar_filename = NULL;
+    const char *prefix;
+    char key[CACHE_KEY_LEN+1] = "-";
+    struct demux_t demux;
+    struct window_t window = { .data = NULL, .position = -1 };
+    int skipped = 0;
+
+    int ret = EXIT_SUCCESS;
 
     for(;;) {
         c = getopt_long(argc, argv, "g:o:", options, &option_index);
@@ -371,6 +4838,103 @@ int main(int argc, char **argv) {
             case 'g':
                 game_id = atoi(optarg);
                 break;
+            case OPTION_PNG_LEVEL:
+                stbi_write_png_compression_level = atoi(optarg);
+                if((stbi_write_png_compression_level < 0) || (stbi_write_png_compression_level > 9)) {
+                    fprintf(stderr, "Invalid PNG compression level. It must be between 0 (store) and 9 (best).\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_PNG_FILTER:
+                stbi_write_force_png_filter = atoi(optarg);
+                if((stbi_write_force_png_filter < -1) || (stbi_write_force_png_filter > 4)) {
+                    fprintf(stderr, "Invalid PNG filter. It must be between 0 and 4, or -1 for adaptive filtering.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_FORMAT:
+                for(g_output_format=g_output_formats; g_output_format->name && strcmp(g_output_format->name, optarg); g_output_format++) {
+                }
+                if(g_output_format->name == NULL) {
+                    fprintf(stderr, "Unknown output format %s.\n", optarg);
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_TAR:
+                tar_filename = optarg;
+                break;
+            case OPTION_PIPE:
+                for(g_output_format=g_pipe_formats; g_output_format->name && strcmp(g_output_format->name, optarg); g_output_format++) {
+                }
+                if(g_output_format->name == NULL) {
+                    fprintf(stderr, "Unknown pipe format %s.\n", optarg);
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_FSYNC:
+                if(strcmp(optarg, "none") == 0) {
+                    g_fsync = FSYNC_NONE;
+                }
+                else if(strcmp(optarg, "file") == 0) {
+                    g_fsync = FSYNC_FILE;
+                }
+                else if(strcmp(optarg, "end") == 0) {
+                    g_fsync = FSYNC_END;
+                }
+                else {
+                    fprintf(stderr, "Invalid fsync policy %s. It must be none, file or end.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_PREALLOCATE:
+                g_preallocate = 1;
+                break;
+            case OPTION_NO_CACHE:
+                g_cache_skip = 0;
+                break;
+            case OPTION_RESUME:
+                g_resume = 1;
+                break;
+            case OPTION_AUDIO:
+                for(g_audio_format=AUDIO_VOX; (g_audio_format<=AUDIO_PCM) && strcmp(g_audio_extension[g_audio_format], optarg); g_audio_format++) {
+                }
+                if(g_audio_format > AUDIO_PCM) {
+                    fprintf(stderr, "Unknown audio format %s. It must be vox, wav or pcm.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_RATE:
+                g_audio_rate = atoi(optarg);
+                if((g_audio_rate < 1000) || (g_audio_rate > 192000)) {
+                    fprintf(stderr, "Invalid sample rate.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_BENCH_KERNELS:
+                return bench_kernels(optarg ? atoi(optarg) : 50);
+            case OPTION_STATS:
+                g_stats.enabled = 1;
+                g_stats.json = optarg;
+                break;
+            case OPTION_TRACE:
+                g_trace.filename = optarg;
+                break;
+            case OPTION_IO_REPORT:
+                g_io.enabled = 1;
+                break;
+            case OPTION_ATLAS:
+                for(g_output_format=g_output_formats; strcmp(g_output_format->name, "atlas"); g_output_format++) {
+                }
+                break;
+            case OPTION_FPS:
+                g_fps = atoi(optarg);
+                if((g_fps < 1) || (g_fps > 65535)) {
+                    fprintf(stderr, "Invalid frame rate.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
             default:
                 usage();
                 return EXIT_FAILURE;
@@ -383,22 +4947,54 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    if((optind + 2) > argc) {
+    if(g_resume && (tar_filename || (g_output_format->flags & OUTPUT_PIPE))) {
+        fprintf(stderr, "--resume can not be used with --tar or --pipe.\n");
+        return EXIT_FAILURE;
+    }
+    if(tar_filename && (g_output_format->flags & OUTPUT_PIPE)) {
+        fprintf(stderr, "--pipe and --tar can not be used together.\n");
+        return EXIT_FAILURE;
+    }
+
+    // The output directory is not needed when everything is written to a tar archive or to the standard output.
+    if((optind + ((tar_filename || (g_output_format->flags & OUTPUT_PIPE)) ? 1 : 2)) > argc) {
         usage();
         return EXIT_FAILURE;
     }
+    prefix = ((optind + 1) < argc) ? argv[optind+1] : ".";
 
+    stats_start();
     in = fopen(argv[optind],"rb");
     if(in == NULL) {
         fprintf(stderr, "failed to open %s: %s\n", argv[optind], strerror(errno));
         return EXIT_FAILURE;
     }
 
+    if(tar_filename) {
+        if(!output_tar_open(tar_filename)) {
+            fclose(in);
+            return EXIT_FAILURE;
+        }
+    }
+    else if(!(g_output_format->flags & OUTPUT_PIPE) && (!output_dir_open(prefix) || !cache_load(prefix))) {
+        output_dir_close();
+        fclose(in);
+        return EXIT_FAILURE;
+    }
+
     // Compute file size.
     fseek(in, 0, SEEK_END);
     input_length = ftell(in);
     fseek(in, 0, SEEK_SET);
     input_length -= ftell(in);
+    g_stats.image_size = input_length;
+
+    if(!journal_open(prefix, argv[optind], input_length, game_id)) {
+        cache_close();
+        output_dir_close();
+        fclose(in);
+        return EXIT_FAILURE;
+    }
 
     if(offset >= 0) {
         count = 1;
@@ -407,20 +5003,117 @@ int main(int argc, char **argv) {
         count = input_length / g_sector_size;
     }
 
-    for(i=0; i<count; i++) {
+    for(i=g_resume_sector; i<count; i++) {
         size_t skip = (offset > 0) ? offset : ((i*g_sector_size) + 0x10);
-        fseek(in, skip, SEEK_SET);
+        int32_t index = (int32_t)i;
+        int64_t frame_count;
+        uint64_t wall = 0;
+        const uint8_t *data;
+        size_t len;
+        stats_stage(STAGE_SCAN);
 
         // Read  Huvideo header.
-        if(!decode_header(in, &header)) {
+        // The sectors are read once, the ones already read for the previous sectors are probed from memory.
+        g_stats.headers_probed++;
+        data = window_get(&window, in, skip, HEADER_SIZE, input_length, &len);
+        if(data == NULL) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+        if(!decode_header(data, len, &header)) {
             continue;
         }
+        g_stats.headers_found++;
+
+        // Gather all the sectors of the video.
+        // Every sector is probed, the video extent is only an estimate.
+        if(!demux_open(&demux, &window, in, skip, video_extent(game_id, &header), input_length)) {
+            fprintf(stderr, "skipping video %04d\n", (int)index);
+            skipped++;
+            continue;
+        }
+        stats_stage(STAGE_OTHER);
+
+        // Skip videos extracted by a previous run with the same settings.
+        if(cache_active()) {
+            if(!cache_key(&demux, game_id, key)) {
+                demux_close(&demux);
+                ret = EXIT_FAILURE;
+                break;
+            }
+            if(!cache_check(prefix, index, key)) {
+                demux_close(&demux);
+                fprintf(stderr, "video %04d is up to date\n", (int)index);
+                if(!journal_done(index, key)) {
+                    ret = EXIT_FAILURE;
+                    break;
+                }
+                continue;
+            }
+        }
 
         // Extract image
-        ret = extract(in, i, skip, game_id, &header, argv[optind+1]);
+        frame_count = g_frame_count;
+        if(g_stats.enabled || g_trace.event) {
+            wall = stats_clock(CLOCK_MONOTONIC);
+        }
+        ret = extract(&demux, index, game_id, &header, prefix);
+        demux_close(&demux);
         if(ret != EXIT_SUCCESS) {
-            return ret;
+            break;
+        }
+        if(g_stats.enabled || g_trace.event) {
+            uint64_t end = stats_clock(CLOCK_MONOTONIC);
+            trace_span("video", wall, end, index, -1);
+            if(g_stats.enabled) {
+                stats_add_video(index, g_frame_count - frame_count, end - wall);
+            }
+        }
+        g_video_count++;
+        if((cache_active() && !cache_set(index, key, g_output_format->name)) || !journal_done(index, key)) {
+            ret = EXIT_FAILURE;
+            break;
         }
+        // Only the first video is streamed to the standard output.
+        if(g_output_format->flags & OUTPUT_PIPE) {
+            break;
+        }
+    }
+
+    // The other videos were extracted, but the exit status reports the missing ones.
+    if(skipped) {
+        ret = EXIT_FAILURE;
+    }
+    if(!output_tar_close()) {
+        fprintf(stderr, "failed to write %s: %s\n", tar_filename, strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+    if(!journal_close() || !cache_save(prefix)) {
+        ret = EXIT_FAILURE;
+    }
+    cache_close();
+    if(!output_dir_close()) {
+        fprintf(stderr, "failed to sync %s: %s\n", prefix, strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+    window_close(&window);
+    fclose(in);
+
+    fprintf(stderr, "%lld videos extracted, %lld frames (%lld duplicates)\n",
+            (long long)g_video_count, (long long)g_frame_count, (long long)g_duplicate_count);
+    if(g_tile_lookups) {
+        fprintf(stderr, "tile cache: %lld hits out of %lld tiles (%.1f%%)\n",
+                (long long)g_tile_hits, (long long)g_tile_lookups, 100.0 * g_tile_hits / g_tile_lookups);
+    }
+    if(g_stats.enabled && !stats_report(g_frame_count, g_duplicate_count, g_tile_lookups, g_tile_hits)) {
+        ret = EXIT_FAILURE;
+    }
+    if(!trace_save()) {
+        ret = EXIT_FAILURE;
+    }
+    if(g_io.enabled) {
+        io_report();
     }
+    free(g_stats.video);
     return ret;
 }
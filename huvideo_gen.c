@@ -0,0 +1,370 @@
+/*
+ * Synthetic HuVideo CDROM image generator.
+ * Writes raw (2352 bytes) mode1 sectors holding HuVideo streams laid out like the ones of Power Golf 2 and
+ * John Madden Duo CD Football, so that huvideo_decode can be benchmarked and tested without the original discs.
+ * Licensed under Public Domain
+ * No warranty implied
+ * Use at your own risk
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#define SECTOR_SIZE 2352
+#define SECTOR_DATA_OFFSET 0x10
+#define SECTOR_DATA_SIZE 2048
+
+#define TILE_POOL_SIZE 64
+
+enum GameID {
+    PowerGolf2,
+    Madden
+};
+
+enum HuVideoFormat {
+    BG = 0,
+    SPR
+};
+
+struct video_desc_t {
+    uint16_t width;
+    uint16_t height;
+    uint8_t format;
+    uint16_t adpcm_len;
+    uint16_t skip;          // sectors between the header and the first frame.
+};
+
+struct generator_t {
+    FILE *out;
+    uint64_t lba;           // current sector.
+    uint64_t state;         // xorshift64 state.
+    uint64_t frame_count;
+    uint8_t sector[SECTOR_SIZE];
+};
+
+static uint32_t gen_random(struct generator_t *gen) {
+    gen->state ^= gen->state << 13;
+    gen->state ^= gen->state >> 7;
+    gen->state ^= gen->state << 17;
+    return (uint32_t)(gen->state >> 32);
+}
+
+static void gen_fill(struct generator_t *gen, uint8_t *out, size_t len) {
+    for(size_t i=0; i<len; i++) {
+        out[i] = gen_random(gen);
+    }
+}
+
+static uint8_t bcd(int v) {
+    return ((v / 10) << 4) | (v % 10);
+}
+
+// Write a mode1 sector with the given user data (zero padded). EDC/ECC are left empty, the decoder ignores them.
+static int gen_write_sector(struct generator_t *gen, const uint8_t *data, size_t len) {
+    uint64_t lba = gen->lba + 150;
+    uint8_t *sector = gen->sector;
+
+    memset(sector, 0, SECTOR_SIZE);
+    memset(sector+1, 0xff, 10);
+    sector[12] = bcd((lba / (75*60)) % 100);
+    sector[13] = bcd((lba / 75) % 60);
+    sector[14] = bcd(lba % 75);
+    sector[15] = 1;
+    memcpy(sector + SECTOR_DATA_OFFSET, data, len);
+    gen->lba++;
+    return fwrite(sector, 1, SECTOR_SIZE, gen->out) == SECTOR_SIZE;
+}
+
+// Filler sectors (random data, without any HuVideo header).
+static int gen_write_gap(struct generator_t *gen, int count) {
+    uint8_t data[SECTOR_DATA_SIZE];
+    int ret = 1;
+    for(int i=0; ret && (i<count); i++) {
+        gen_fill(gen, data, SECTOR_DATA_SIZE);
+        ret = gen_write_sector(gen, data, SECTOR_DATA_SIZE);
+    }
+    return ret;
+}
+
+// Number of sectors read by the decoder for the adpcm data. The data starts 0x40 bytes after the header and the
+// last sector only provides the bytes that are still missing (see adpcm_read in huvideo_decode.c).
+static int adpcm_extent(uint16_t adpcm_len) {
+    if(adpcm_len == 0) {
+        return 0;
+    }
+    if(adpcm_len < 2048) {
+        return 2;
+    }
+    return (adpcm_len + 0x40 + 2047) / 2048;
+}
+
+// Stream layout of a video of the given size. See video_layout in huvideo_decode.c.
+static int video_describe(int game_id, int width, int height, int adpcm_len, struct video_desc_t *desc) {
+    desc->width = width;
+    desc->height = height;
+    desc->format = BG;
+    desc->adpcm_len = 0;
+    if(game_id == PowerGolf2) {
+        desc->skip = 8;
+    }
+    else if((width == 0x100) && (height == 0x70)) {
+        desc->skip = 4;
+    }
+    else {
+        if((width != 0x80) || (height != 0x80)) {
+            desc->format = SPR;
+        }
+        desc->adpcm_len = adpcm_len;
+        desc->skip = adpcm_extent(adpcm_len);
+        if(desc->skip < 2) {
+            desc->skip = 2;
+        }
+    }
+    if(desc->format == BG) {
+        return (width > 0) && (width <= 512) && (height > 0) && (height <= 512) && !(width % 8) && !(height % 8);
+    }
+    // Sprite cells are laid out in columns of 2 cells (see sprite_to_rgb8).
+    return (height > 0) && (height <= 256) && !(height % 16) && (width == (2 * height));
+}
+
+// Write the frames of a video. Frames are made of tiles (BG) or cells (SPR) picked in a small pool, a band of
+// cells changes from one frame to the next. Each frame is repeated hold times.
+static int gen_write_frames(struct generator_t *gen, const struct video_desc_t *desc, int frames, int hold) {
+    size_t cell_size = (desc->format == BG) ? 32 : 128;
+    size_t frame_size = desc->width * desc->height / 2;
+    size_t cell_count = frame_size / cell_size;
+    size_t sectors = (frame_size + SECTOR_DATA_SIZE - 1) / SECTOR_DATA_SIZE;
+    uint8_t *pool, *frame;
+    uint8_t *map;
+    int ret = 1;
+
+    pool = (uint8_t*)malloc(TILE_POOL_SIZE * cell_size);
+    map = (uint8_t*)malloc(cell_count);
+    frame = (uint8_t*)calloc(sectors, SECTOR_DATA_SIZE);
+    if((pool == NULL) || (map == NULL) || (frame == NULL)) {
+        fprintf(stderr, "failed to allocate frame buffers: %s\n", strerror(errno));
+        ret = 0;
+    }
+    else {
+        gen_fill(gen, pool, TILE_POOL_SIZE * cell_size);
+        // The first tile of the pool is blank (background).
+        memset(pool, 0, cell_size);
+        for(size_t n=0; n<cell_count; n++) {
+            map[n] = (gen_random(gen) % 4) ? 0 : (gen_random(gen) % TILE_POOL_SIZE);
+        }
+    }
+
+    for(int k=0; ret && (k<frames); k++) {
+        if((k % hold) == 0) {
+            size_t band = cell_count / 8 + 1;
+            size_t start = ((size_t)(k / hold) * band / 2) % cell_count;
+            for(size_t n=0; n<band; n++) {
+                map[(start + n) % cell_count] = gen_random(gen) % TILE_POOL_SIZE;
+            }
+            for(size_t n=0; n<cell_count; n++) {
+                memcpy(frame + n*cell_size, pool + map[n]*cell_size, cell_size);
+            }
+        }
+        for(size_t s=0; ret && (s<sectors); s++) {
+            size_t len = frame_size - s*SECTOR_DATA_SIZE;
+            ret = gen_write_sector(gen, frame + s*SECTOR_DATA_SIZE, (len > SECTOR_DATA_SIZE) ? SECTOR_DATA_SIZE : len);
+        }
+        gen->frame_count++;
+    }
+
+    free(pool);
+    free(map);
+    free(frame);
+    return ret;
+}
+
+static int gen_write_video(struct generator_t *gen, const struct video_desc_t *desc, int frames, int hold) {
+    uint8_t *data;
+    size_t header_len = (size_t)desc->skip * SECTOR_DATA_SIZE;
+    int ret = 1;
+
+    // Header, palette and adpcm data are stored in the first skip sectors.
+    data = (uint8_t*)calloc(desc->skip, SECTOR_DATA_SIZE);
+    if(data == NULL) {
+        fprintf(stderr, "failed to allocate header: %s\n", strerror(errno));
+        return 0;
+    }
+    memcpy(data, "HuVIDEO         ", 16);
+    data[16] = frames;
+    data[17] = frames >> 8;
+    data[18] = desc->width;
+    data[19] = desc->width >> 8;
+    data[20] = desc->height;
+    data[21] = desc->height >> 8;
+    data[22] = 0;                       // palette flag
+    data[23] = desc->format;
+    data[24] = desc->adpcm_len;
+    data[25] = desc->adpcm_len >> 8;
+    data[26] = desc->skip;              // Madden: sectors before the first frame.
+    data[27] = desc->skip >> 8;
+    // 16 colors palette, 9 bits GRB.
+    for(int i=0; i<16; i++) {
+        uint16_t color = (i == 0) ? 0 : (gen_random(gen) & 0x1ff);
+        data[0x20 + 2*i] = color;
+        data[0x20 + 2*i + 1] = color >> 8;
+    }
+    if(desc->adpcm_len) {
+        // Any byte is a valid pair of ADPCM nibbles. Keep the step index low so that it sounds like noise.
+        uint8_t *adpcm = data + 0x40;
+        size_t len = desc->adpcm_len;
+        if(len > (header_len - 0x40)) {
+            len = header_len - 0x40;
+        }
+        for(size_t i=0; i<len; i++) {
+            adpcm[i] = gen_random(gen) & 0x33;
+        }
+    }
+    for(int s=0; ret && (s<desc->skip); s++) {
+        ret = gen_write_sector(gen, data + s*SECTOR_DATA_SIZE, SECTOR_DATA_SIZE);
+    }
+    free(data);
+
+    return ret && gen_write_frames(gen, desc, frames, hold);
+}
+
+enum OptionID {
+    OPTION_VIDEOS = 0x100,
+    OPTION_FRAMES,
+    OPTION_SIZE,
+    OPTION_HOLD,
+    OPTION_GAP,
+    OPTION_ADPCM,
+    OPTION_SEED
+};
+
+void usage() {
+    fprintf(stderr, "huvideo_gen [-g/--game G] [--videos N] [--frames N] [--size WxH] [--hold N] [--gap N] [--adpcm N] [--seed N] out\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    int option_index;
+
+    const struct option options[] = {
+        {"game",    required_argument, 0, 'g' },
+        {"videos",  required_argument, 0, OPTION_VIDEOS },
+        {"frames",  required_argument, 0, OPTION_FRAMES },
+        {"size",    required_argument, 0, OPTION_SIZE },
+        {"hold",    required_argument, 0, OPTION_HOLD },
+        {"gap",     required_argument, 0, OPTION_GAP },
+        {"adpcm",   required_argument, 0, OPTION_ADPCM },
+        {"seed",    required_argument, 0, OPTION_SEED },
+        {0,         0,                 0,  0 }
+    };
+
+    // Madden streams come in 3 flavors: 256x112 BG without audio, 128x128 BG and 128x64 sprites with adpcm data.
+    static const uint16_t madden_sizes[3][2] = { { 256, 112 }, { 128, 128 }, { 128, 64 } };
+
+    struct generator_t gen;
+    int game_id = PowerGolf2;
+    int videos = 4;
+    int frames = 100;
+    int width = 0, height = 0;
+    int hold = 1;
+    int gap = 16;
+    int adpcm_len = 8000;
+    uint64_t seed = 1;
+    int ret = EXIT_SUCCESS;
+
+    for(;;) {
+        c = getopt_long(argc, argv, "g:", options, &option_index);
+        if(c < 0) {
+            break;
+        }
+        switch(c) {
+            case 'g':
+                game_id = atoi(optarg);
+                break;
+            case OPTION_VIDEOS:
+                videos = atoi(optarg);
+                break;
+            case OPTION_FRAMES:
+                frames = atoi(optarg);
+                break;
+            case OPTION_SIZE:
+                if(sscanf(optarg, "%dx%d", &width, &height) != 2) {
+                    fprintf(stderr, "Invalid frame size %s. It must be WIDTHxHEIGHT.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_HOLD:
+                hold = atoi(optarg);
+                break;
+            case OPTION_GAP:
+                gap = atoi(optarg);
+                break;
+            case OPTION_ADPCM:
+                adpcm_len = atoi(optarg);
+                break;
+            case OPTION_SEED:
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if((game_id < 0) || (game_id > Madden)) {
+        fprintf(stderr, "Invalid game id. It must be either 0 (Power Golf 2 - Golfer) or 1 (John Madden Duo CD Football).\n");
+        return EXIT_FAILURE;
+    }
+    if((videos < 0) || (frames < 1) || (frames > 65535) || (hold < 1) || (gap < 0)) {
+        fprintf(stderr, "Invalid video count, frame count, hold or gap.\n");
+        return EXIT_FAILURE;
+    }
+    if((adpcm_len < 0x40) || (adpcm_len > 65535)) {
+        fprintf(stderr, "Invalid adpcm length. It must be between 64 and 65535.\n");
+        return EXIT_FAILURE;
+    }
+    if(optind >= argc) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    memset(&gen, 0, sizeof(gen));
+    gen.state = seed ? seed : 1;
+    gen.out = fopen(argv[optind], "wb");
+    if(gen.out == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", argv[optind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    for(int v=0; (v<videos) && (ret == EXIT_SUCCESS); v++) {
+        struct video_desc_t desc;
+        int w = width, h = height;
+        if(!w) {
+            w = (game_id == Madden) ? madden_sizes[v % 3][0] : 256;
+            h = (game_id == Madden) ? madden_sizes[v % 3][1] : 112;
+        }
+        if(!video_describe(game_id, w, h, adpcm_len, &desc)) {
+            fprintf(stderr, "Invalid frame size %dx%d.\n", w, h);
+            ret = EXIT_FAILURE;
+        }
+        else if(!gen_write_gap(&gen, gap) || !gen_write_video(&gen, &desc, frames, hold)) {
+            ret = EXIT_FAILURE;
+        }
+    }
+    if((ret == EXIT_SUCCESS) && !gen_write_gap(&gen, gap)) {
+        ret = EXIT_FAILURE;
+    }
+    if(fclose(gen.out) != 0) {
+        ret = EXIT_FAILURE;
+    }
+    if(ret != EXIT_SUCCESS) {
+        fprintf(stderr, "failed to write %s: %s\n", argv[optind], strerror(errno));
+        return ret;
+    }
+
+    fprintf(stderr, "%d videos, %llu frames, %llu sectors (%.1f MB)\n", videos, (unsigned long long)gen.frame_count,
+            (unsigned long long)gen.lba, gen.lba * (double)SECTOR_SIZE / (1024.0 * 1024.0));
+    return ret;
+}
@@ -0,0 +1,134 @@
+/*
+ * HuVideo raw frame store reader.
+ *
+ * huvideo_decode --format raw (or raw-rgb) writes each video as a single file made of a fixed size header
+ * followed by the frames stored one after the other. Every frame has the same size, frame k starts at
+ * frame_offset + k*frame_size. All the header fields are little endian.
+ *
+ *   offset  size  field
+ *   0       8     magic ("HUVFRAME")
+ *   8       2     version (1)
+ *   10      2     pixel format (0: one palette index per byte, 1: RGB, 3 bytes per pixel)
+ *   12      2     width
+ *   14      2     height
+ *   16      4     frame count
+ *   20      4     frame rate
+ *   24      4     frame offset (offset of the first frame)
+ *   28      4     frame size (in bytes)
+ *   32      48    palette (16 RGB colors)
+ *   80      48    reserved (0)
+ *
+ * Usage:
+ *   struct huvideo_store_t store;
+ *   if(huvideo_store_open(&store, "0429.frames")) {
+ *       for(uint32_t k=0; k<store.frame_count; k++) {
+ *           const uint8_t *frame = huvideo_store_frame(&store, k);
+ *           ...
+ *       }
+ *       huvideo_store_close(&store);
+ *   }
+ */
+#ifndef HUVIDEO_STORE_H
+#define HUVIDEO_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HUVIDEO_STORE_MAGIC "HUVFRAME"
+#define HUVIDEO_STORE_VERSION 1
+#define HUVIDEO_STORE_HEADER_SIZE 128
+
+enum HuVideoStorePixelFormat {
+    HUVIDEO_STORE_INDEXED = 0,
+    HUVIDEO_STORE_RGB = 1
+};
+
+struct huvideo_store_t {
+    int pixel_format;
+    int width;
+    int height;
+    uint32_t frame_count;
+    uint32_t fps;
+    uint32_t frame_offset;
+    uint32_t frame_size;
+    uint8_t palette[16*3];
+
+    const uint8_t *data;    // mapped file.
+    size_t size;
+};
+
+static inline uint32_t huvideo_store_get16(const uint8_t *in) {
+    return in[0] | (in[1] << 8);
+}
+
+static inline uint32_t huvideo_store_get32(const uint8_t *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+// Parse a store header. Returns 1 if the header is valid and the frames fit in size bytes.
+static inline int huvideo_store_parse(struct huvideo_store_t *store, const uint8_t *data, size_t size) {
+    if((size < HUVIDEO_STORE_HEADER_SIZE) || memcmp(data, HUVIDEO_STORE_MAGIC, 8)
+    || (huvideo_store_get16(data+8) != HUVIDEO_STORE_VERSION)) {
+        return 0;
+    }
+    store->pixel_format = huvideo_store_get16(data+10);
+    store->width = huvideo_store_get16(data+12);
+    store->height = huvideo_store_get16(data+14);
+    store->frame_count = huvideo_store_get32(data+16);
+    store->fps = huvideo_store_get32(data+20);
+    store->frame_offset = huvideo_store_get32(data+24);
+    store->frame_size = huvideo_store_get32(data+28);
+    memcpy(store->palette, data+32, 16*3);
+    store->data = data;
+    store->size = size;
+    return (store->frame_offset >= HUVIDEO_STORE_HEADER_SIZE)
+        && (store->frame_offset <= size)
+        && (((uint64_t)store->frame_size * store->frame_count) <= (size - store->frame_offset));
+}
+
+// Map a store file in memory.
+static inline int huvideo_store_open(struct huvideo_store_t *store, const char *filename) {
+    struct stat st;
+    void *data;
+    int fd;
+
+    memset(store, 0, sizeof(struct huvideo_store_t));
+    fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+    if((fstat(fd, &st) < 0) || (st.st_size < HUVIDEO_STORE_HEADER_SIZE)) {
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        return 0;
+    }
+    if(!huvideo_store_parse(store, (const uint8_t*)data, st.st_size)) {
+        munmap(data, st.st_size);
+        memset(store, 0, sizeof(struct huvideo_store_t));
+        return 0;
+    }
+    return 1;
+}
+
+static inline void huvideo_store_close(struct huvideo_store_t *store) {
+    if(store->data) {
+        munmap((void*)store->data, store->size);
+    }
+    memset(store, 0, sizeof(struct huvideo_store_t));
+}
+
+// Frame k pixels (width*height palette indices or width*height*3 RGB bytes).
+static inline const uint8_t* huvideo_store_frame(const struct huvideo_store_t *store, uint32_t k) {
+    return store->data + store->frame_offset + (size_t)k * store->frame_size;
+}
+
+#endif // HUVIDEO_STORE_H
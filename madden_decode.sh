@@ -11,12 +11,4 @@ fi
 
 mkdir -p ./output
 
-${1} -g 1 "${2}" ./output 2> /dev/null
-
-for i in ./output/* ; do
-    if [ -d "${i}" ]; then
-        out="${i}.gif"
-        ffmpeg -y -i "${i}/%06d.png" "${out}"
-        rm -rf "${i}"
-    fi
-done
+${1} -g 1 --format gif "${2}" ./output 2> /dev/null
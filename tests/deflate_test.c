@@ -0,0 +1,325 @@
+/*
+ * Deflate backend test.
+ * Compresses a few buffers (zeros, random bytes, short repeated patterns) at every level, through the one-shot
+ * (huvideo_zlib_compress) and streaming (deflate_write/deflate_finish) paths, and decodes the result with a minimal
+ * inflater: the output must be a valid zlib stream holding exactly the input. Build it with AddressSanitizer so that
+ * any access past the input is reported:
+ *   gcc -g -fsanitize=address,undefined tests/deflate_test.c -o deflate_test && ./deflate_test
+ */
+#define main huvideo_decode_main
+#include "../huvideo_decode.c"
+#undef main
+
+#define TEST_SIZE 65536
+
+// Minimal inflater (RFC 1950/1951), used to check that the compressed data decodes to the input.
+struct inflate_t {
+    const uint8_t *in;
+    size_t in_len;
+    size_t pos;
+    uint32_t bits;
+    int bit_count;
+    int error;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_capacity;
+};
+
+struct huffman_t {
+    uint16_t count[16];     // number of codes of each length.
+    uint16_t symbol[288];   // symbols ordered by code.
+};
+
+static uint32_t inflate_bits(struct inflate_t *s, int n) {
+    uint32_t v;
+    while(s->bit_count < n) {
+        if(s->pos >= s->in_len) {
+            s->error = 1;
+            return 0;
+        }
+        s->bits |= (uint32_t)s->in[s->pos++] << s->bit_count;
+        s->bit_count += 8;
+    }
+    v = s->bits & ((1U << n) - 1);
+    s->bits >>= n;
+    s->bit_count -= n;
+    return v;
+}
+
+static int inflate_put(struct inflate_t *s, uint8_t c) {
+    if(s->out_len >= s->out_capacity) {
+        s->error = 1;
+        return 0;
+    }
+    s->out[s->out_len++] = c;
+    return 1;
+}
+
+static void huffman_build(struct huffman_t *h, const uint8_t *lengths, int n) {
+    uint16_t offset[16];
+    memset(h->count, 0, sizeof(h->count));
+    for(int i=0; i<n; i++) {
+        h->count[lengths[i]]++;
+    }
+    h->count[0] = 0;
+    offset[1] = 0;
+    for(int len=1; len<15; len++) {
+        offset[len+1] = offset[len] + h->count[len];
+    }
+    for(int i=0; i<n; i++) {
+        if(lengths[i]) {
+            h->symbol[offset[lengths[i]]++] = i;
+        }
+    }
+}
+
+// Codes are read one bit at a time, most significant bit first.
+static int huffman_decode(struct inflate_t *s, const struct huffman_t *h) {
+    int code = 0, first = 0, index = 0;
+    for(int len=1; len<16; len++) {
+        code |= inflate_bits(s, 1);
+        int count = h->count[len];
+        if((code - count) < first) {
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    s->error = 1;
+    return -1;
+}
+
+static int inflate_codes(struct inflate_t *s, const struct huffman_t *lit, const struct huffman_t *dist) {
+    static const uint16_t len_base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const uint16_t dist_base[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+        8193, 12289, 16385, 24577
+    };
+    static const uint8_t dist_extra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+    for(;;) {
+        int symbol = huffman_decode(s, lit);
+        if(s->error || (symbol == 256)) {
+            return !s->error;
+        }
+        if(symbol < 256) {
+            if(!inflate_put(s, symbol)) {
+                return 0;
+            }
+            continue;
+        }
+        symbol -= 257;
+        if(symbol >= 29) {
+            return 0;
+        }
+        size_t len = len_base[symbol] + inflate_bits(s, len_extra[symbol]);
+        symbol = huffman_decode(s, dist);
+        if(s->error || (symbol < 0) || (symbol >= 30)) {
+            return 0;
+        }
+        size_t d = dist_base[symbol] + inflate_bits(s, dist_extra[symbol]);
+        if(s->error || (d > s->out_len)) {
+            return 0;
+        }
+        while(len--) {
+            if(!inflate_put(s, s->out[s->out_len - d])) {
+                return 0;
+            }
+        }
+    }
+}
+
+static int inflate_dynamic(struct inflate_t *s) {
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    uint8_t lengths[320];
+    struct huffman_t lit, dist;
+    int nlen = inflate_bits(s, 5) + 257;
+    int ndist = inflate_bits(s, 5) + 1;
+    int ncode = inflate_bits(s, 4) + 4;
+
+    memset(lengths, 0, sizeof(lengths));
+    for(int i=0; i<ncode; i++) {
+        lengths[order[i]] = inflate_bits(s, 3);
+    }
+    huffman_build(&lit, lengths, 19);
+    for(int i=0; (i<(nlen + ndist)) && !s->error; ) {
+        int symbol = huffman_decode(s, &lit);
+        int repeat;
+        uint8_t value = 0;
+        if(symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+        if(symbol == 16) {
+            if(i == 0) {
+                return 0;
+            }
+            value = lengths[i-1];
+            repeat = 3 + inflate_bits(s, 2);
+        }
+        else if(symbol == 17) {
+            repeat = 3 + inflate_bits(s, 3);
+        }
+        else {
+            repeat = 11 + inflate_bits(s, 7);
+        }
+        if((i + repeat) > (nlen + ndist)) {
+            return 0;
+        }
+        while(repeat--) {
+            lengths[i++] = value;
+        }
+    }
+    if(s->error) {
+        return 0;
+    }
+    huffman_build(&lit, lengths, nlen);
+    huffman_build(&dist, lengths + nlen, ndist);
+    return inflate_codes(s, &lit, &dist);
+}
+
+static int inflate_fixed(struct inflate_t *s) {
+    uint8_t lengths[320];
+    struct huffman_t lit, dist;
+    for(int i=0; i<288; i++) {
+        lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+    }
+    huffman_build(&lit, lengths, 288);
+    for(int i=0; i<30; i++) {
+        lengths[i] = 5;
+    }
+    huffman_build(&dist, lengths, 30);
+    return inflate_codes(s, &lit, &dist);
+}
+
+static int inflate_stored(struct inflate_t *s) {
+    uint32_t len, nlen;
+    s->bits = 0;
+    s->bit_count = 0;
+    if((s->pos + 4) > s->in_len) {
+        return 0;
+    }
+    len = s->in[s->pos] | (s->in[s->pos+1] << 8);
+    nlen = s->in[s->pos+2] | (s->in[s->pos+3] << 8);
+    s->pos += 4;
+    if((len != (~nlen & 0xffff)) || ((s->pos + len) > s->in_len)) {
+        return 0;
+    }
+    while(len--) {
+        if(!inflate_put(s, s->in[s->pos++])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Decode a zlib stream in out (at most capacity bytes). Returns the decoded size, or -1 if the stream is invalid.
+static long zlib_uncompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t capacity) {
+    struct inflate_t s;
+    uint32_t adler;
+    int last;
+
+    memset(&s, 0, sizeof(s));
+    s.in = in;
+    s.in_len = in_len;
+    s.out = out;
+    s.out_capacity = capacity;
+    if((in_len < 6) || ((in[0] & 0x0f) != 8) || ((((in[0] << 8) | in[1]) % 31) != 0) || (in[1] & 0x20)) {
+        return -1;
+    }
+    s.pos = 2;
+    do {
+        int ok;
+        last = inflate_bits(&s, 1);
+        switch(inflate_bits(&s, 2)) {
+            case 0:  ok = inflate_stored(&s); break;
+            case 1:  ok = inflate_fixed(&s); break;
+            case 2:  ok = inflate_dynamic(&s); break;
+            default: ok = 0; break;
+        }
+        if(!ok || s.error) {
+            return -1;
+        }
+    } while(!last);
+    // The Adler-32 checksum follows the last block, on a byte boundary.
+    if((s.pos + 4) != in_len) {
+        return -1;
+    }
+    adler = ((uint32_t)in[s.pos] << 24) | (in[s.pos+1] << 16) | (in[s.pos+2] << 8) | in[s.pos+3];
+    if(adler != adler32(1, out, s.out_len)) {
+        return -1;
+    }
+    return (long)s.out_len;
+}
+
+static int test_output(const char *name, int level, const uint8_t *out, size_t out_len, const uint8_t *data, size_t len) {
+    // One more byte so that extra output is detected.
+    uint8_t *decoded = (uint8_t*)malloc(len + 1);
+    long decoded_len = decoded ? zlib_uncompress(out, out_len, decoded, len + 1) : -1;
+    int ok = (decoded_len >= 0) && ((size_t)decoded_len == len) && !memcmp(decoded, data, (size_t)decoded_len);
+    if(!ok) {
+        fprintf(stderr, "%s level %d: %s\n", name, level, (decoded_len < 0) ? "invalid zlib stream" : "decoded data differs");
+    }
+    free(decoded);
+    return ok;
+}
+
+static int test_buffer(const char *name, const uint8_t *data, size_t len) {
+    int ok = 1;
+    for(int level=0; level<=9; level++) {
+        // One-shot: the input is an exactly sized heap buffer.
+        uint8_t *copy = (uint8_t*)malloc(len ? len : 1);
+        int out_len = 0;
+        memcpy(copy, data, len);
+        uint8_t *out = huvideo_zlib_compress(copy, (int)len, &out_len, level);
+        ok = out && test_output(name, level, out, out_len, data, len) && ok;
+        free(out);
+        free(copy);
+
+        // Streaming, with odd sized writes.
+        struct deflate_t *z = deflate_open(level, 1, len/2);
+        size_t pos = 0;
+        ok = (z != NULL) && ok;
+        while(z && (pos < len)) {
+            size_t n = ((len - pos) > 1531) ? 1531 : (len - pos);
+            ok = deflate_write(z, data + pos, n) && ok;
+            pos += n;
+        }
+        if(z) {
+            ok = deflate_finish(z) && test_output(name, level, z->out, z->out_len, data, len) && ok;
+            deflate_close(z);
+        }
+    }
+    fprintf(stderr, "%-8s %s\n", name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main() {
+    uint8_t *data = (uint8_t*)malloc(4 * TEST_SIZE);
+    uint32_t seed = 1;
+    int ok = 1;
+
+    memset(data, 0, 4 * TEST_SIZE);
+    ok = test_buffer("zeros", data, TEST_SIZE) && ok;
+    ok = test_buffer("large", data, 4 * TEST_SIZE) && ok;
+    for(size_t i=0; i<TEST_SIZE; i++) {
+        data[i] = i % 7;
+    }
+    ok = test_buffer("pattern", data, TEST_SIZE) && ok;
+    for(size_t i=0; i<TEST_SIZE; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        data[i] = seed & 3;
+    }
+    ok = test_buffer("random", data, TEST_SIZE) && ok;
+    ok = test_buffer("short", data, 5) && ok;
+    ok = test_buffer("empty", data, 0) && ok;
+    free(data);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
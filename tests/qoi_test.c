@@ -0,0 +1,221 @@
+/*
+ * QOI output test.
+ * Converts a few frames (random tiles and sprites, a flat frame, small color steps) to RGB, writes them with
+ * qoi_frame in a temporary directory, and decodes the files with a minimal QOI decoder: the pixels must match the
+ * RGB frame and the file must end with the 8 bytes end marker.
+ *   gcc -g -fsanitize=address,undefined tests/qoi_test.c -o qoi_test && ./qoi_test
+ */
+#define main huvideo_decode_main
+#include "../huvideo_decode.c"
+#undef main
+
+static uint32_t test_get32(const uint8_t *in) {
+    return ((uint32_t)in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+}
+
+// Decode a QOI file to RGB8. Returns 0 if the file is invalid or does not hold a width x height RGB image.
+static int qoi_decode(const uint8_t *data, size_t len, uint8_t *rgb, int width, int height) {
+    static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    uint8_t index[64][4];
+    uint8_t px[4] = { 0, 0, 0, 255 };
+    size_t count = (size_t)width * height;
+    size_t pos = 14;
+    int run = 0;
+
+    if((len < (14 + 8)) || memcmp(data, "qoif", 4) || (test_get32(data+4) != (uint32_t)width)
+    || (test_get32(data+8) != (uint32_t)height) || (data[12] != 3) || (data[13] > 1)) {
+        return 0;
+    }
+    memset(index, 0, sizeof(index));
+    for(size_t i=0; i<count; i++, rgb+=3) {
+        if(run) {
+            run--;
+        }
+        else {
+            uint8_t b;
+            if(pos >= (len - 8)) {
+                return 0;
+            }
+            b = data[pos++];
+            if(b == QOI_OP_RGB) {
+                if((pos + 3) > (len - 8)) {
+                    return 0;
+                }
+                px[0] = data[pos++];
+                px[1] = data[pos++];
+                px[2] = data[pos++];
+            }
+            else if(b == 0xff) {
+                // QOI_OP_RGBA is never written for RGB images.
+                return 0;
+            }
+            else if((b & 0xc0) == QOI_OP_INDEX) {
+                memcpy(px, index[b & 0x3f], 4);
+            }
+            else if((b & 0xc0) == QOI_OP_DIFF) {
+                px[0] += ((b >> 4) & 3) - 2;
+                px[1] += ((b >> 2) & 3) - 2;
+                px[2] += (b & 3) - 2;
+            }
+            else if((b & 0xc0) == QOI_OP_LUMA) {
+                int dg;
+                if(pos >= (len - 8)) {
+                    return 0;
+                }
+                dg = (b & 0x3f) - 32;
+                px[0] += dg + ((data[pos] >> 4) & 0x0f) - 8;
+                px[1] += dg;
+                px[2] += dg + (data[pos] & 0x0f) - 8;
+                pos++;
+            }
+            else {
+                run = b & 0x3f;
+            }
+            memcpy(index[(px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11) % 64], px, 4);
+        }
+        memcpy(rgb, px, 3);
+    }
+    // Nothing but the end marker may follow the last pixel.
+    return ((pos + 8) == len) && !memcmp(data + pos, end, 8);
+}
+
+static uint8_t* read_file(const char *filename, size_t *len) {
+    FILE *in = fopen(filename, "rb");
+    uint8_t *data;
+    long size;
+    if(in == NULL) {
+        return NULL;
+    }
+    fseek(in, 0, SEEK_END);
+    size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    data = (uint8_t*)malloc(size ? size : 1);
+    *len = fread(data, 1, size, in);
+    fclose(in);
+    return data;
+}
+
+static uint32_t test_random(uint32_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+// Fill the RGB buffer of frame k.
+static void test_frame(struct video_t *video, int k, uint32_t *seed) {
+    struct header_t *header = video->header;
+    size_t pixels = header->width * header->height;
+    size_t vram_size = pixels / 2;
+    uint8_t *vram = (uint8_t*)malloc(vram_size);
+
+    switch(k) {
+        case 0:
+            // Random indices.
+            for(size_t i=0; i<vram_size; i++) {
+                vram[i] = test_random(seed);
+            }
+            break;
+        case 1:
+            // A few distinct tiles, like real backgrounds.
+            for(size_t i=0; i<vram_size; i++) {
+                vram[i] = (i < (32*4)) ? test_random(seed) : vram[i % (32*4)];
+            }
+            break;
+        default:
+            // Flat frame (long runs).
+            memset(vram, 0, vram_size);
+            break;
+    }
+    if(header->format == BG) {
+        tile_to_rgb8(video->rgb, vram, video->palette, header, NULL);
+    }
+    else {
+        sprite_to_rgb8(video->rgb, vram, video->palette, header);
+    }
+    if(k == 3) {
+        // Small random steps between neighbour pixels (QOI_OP_DIFF and QOI_OP_LUMA, and their limits).
+        uint8_t px[3] = { 128, 128, 128 };
+        for(size_t i=0; i<pixels; i++) {
+            uint32_t r = test_random(seed);
+            int range = (r & 0x100) ? 5 : 71;
+            int dg = (int)((r >> 9) % range) - (range / 2);
+            px[0] += dg + (int)(r % 19) - 9;
+            px[1] += dg;
+            px[2] += dg + (int)((r >> 16) % 19) - 9;
+            memcpy(video->rgb + 3*i, px, 3);
+        }
+    }
+    free(vram);
+}
+
+static int test_video(const char *dir, int format, int width, int height, uint32_t *seed) {
+    struct header_t header;
+    struct video_t video;
+    uint8_t *decoded;
+    int ok = 1;
+
+    memset(&header, 0, sizeof(header));
+    header.width = width;
+    header.height = height;
+    header.format = format;
+    header.frames = 4;
+
+    memset(&video, 0, sizeof(video));
+    video.index = width;
+    video.header = &header;
+    video.prefix = dir;
+    video.filename_len = strlen(dir) + 32;
+    video.filename = (char*)malloc(video.filename_len);
+    video.rgb = (uint8_t*)malloc(width * height * 3);
+    decoded = (uint8_t*)malloc(width * height * 3);
+    for(int i=0; i<(16*3); i++) {
+        video.palette[i] = 255 * (test_random(seed) & 7) / 7;
+    }
+
+    ok = qoi_begin(&video);
+    for(int k=0; ok && (k<header.frames); k++) {
+        char filename[512];
+        uint8_t *data;
+        size_t len = 0;
+
+        test_frame(&video, k, seed);
+        ok = qoi_frame(&video, k);
+        snprintf(filename, sizeof(filename), "%s/%04d/%06d.qoi", dir, video.index, k);
+        data = ok ? read_file(filename, &len) : NULL;
+        ok = data && qoi_decode(data, len, decoded, width, height) && !memcmp(decoded, video.rgb, width * height * 3);
+        if(!ok) {
+            fprintf(stderr, "%s %dx%d frame %d: %s\n", (format == BG) ? "BG" : "SPR", width, height, k,
+                    data ? "decoded frame differs" : "failed to write");
+        }
+        free(data);
+        unlink(filename);
+    }
+    ok = qoi_end(&video) && ok;
+    output_video_dir_close();
+    snprintf(video.filename, video.filename_len, "%s/%04d", dir, video.index);
+    rmdir(video.filename);
+
+    fprintf(stderr, "%-3s %4dx%-4d %s\n", (format == BG) ? "BG" : "SPR", width, height, ok ? "ok" : "FAILED");
+    free(video.filename);
+    free(video.rgb);
+    free(decoded);
+    return ok;
+}
+
+int main() {
+    char dir[] = "/tmp/qoi_test.XXXXXX";
+    uint32_t seed = 1;
+    int ok = 1;
+
+    if((mkdtemp(dir) == NULL) || !output_dir_open(dir)) {
+        fprintf(stderr, "failed to create a temporary directory\n");
+        return EXIT_FAILURE;
+    }
+    ok = test_video(dir, BG, 256, 112, &seed) && ok;
+    ok = test_video(dir, BG, 128, 128, &seed) && ok;
+    ok = test_video(dir, SPR, 128, 64, &seed) && ok;
+    ok = output_dir_close() && ok;
+    rmdir(dir);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}